@@ -0,0 +1,1279 @@
+// Benchmark harness for the SH1107 chip: runs src/main.c natively against
+// the stub simulator in wokwi-stub.c, and reports ingest and render costs.
+//
+// SPDX-License-Identifier: MIT
+// Copyright (C) 2024 Uri Shaked / wokwi.com
+
+#include "wokwi-stub.h"
+#include "sh1107-trace.h"
+#include "sh1107-capture.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FRAME_NANOS 20000000ULL // time between two frames of the workload: longer than the refresh interval
+#define DEFAULT_FRAMES 500
+#define DEFAULT_CHECK_ROUNDS 30
+#define REPEATS 5 // runs of the suite: the fastest run of each scenario is reported, to filter out noise
+#define DEFAULT_THRESHOLD 25 // percent, see compare_results()
+// Timing differences below these are noise, whatever the threshold
+#define MIN_INGEST_REGRESSION 1.0  // ns per byte
+#define MIN_RENDER_REGRESSION 200.0 // ns per frame
+#define MAX_SCENARIOS 32
+#define COMPARE_ATTEMPTS 3 // suite runs before a regression is reported: a real one persists
+#define ADAPTIVE_BURST_FRAMES 50 // workload frames per cycle of the adaptive-bursts scenario
+#define ADAPTIVE_IDLE_FRAMES 10  // of which idle at the end
+
+// Per-pixel renderer of src/main.c, built with SH1107_REFERENCE_CHECK
+void sh1107_render_reference(void *chip, uint32_t *image);
+void sh1107_release_instances(void);
+
+typedef struct {
+  const char *name;
+  void (*setup)(uint32_t device);
+  void (*frame)(uint32_t device, uint32_t index);
+  uint32_t width; // panel size, 0 for the default 128x128
+  uint32_t height;
+  void (*configure)(uint32_t device); // sets the attributes and symbols before chip_init(), may be NULL
+  uint32_t instances;                  // number of displays on the bus, 0 for one
+} scenario_t;
+
+typedef struct {
+  uint64_t ingest_nanos;
+  uint64_t ingest_bytes;
+  uint64_t render_nanos;
+  uint32_t frames;
+  stub_counters_t host;
+} result_t;
+
+// The per-byte and per-frame figures of a result, as printed and stored in the results file
+typedef struct {
+  char name[32];
+  double ingest_ns_per_byte;
+  double render_ns_per_frame;
+  double writes_per_frame;
+  double bytes_per_frame;
+} metrics_t;
+
+static uint64_t ingest_bytes;
+
+// Starts a new simulation: the chip instances of the previous one are discarded
+static void restart(void) {
+  stub_reset();
+  sh1107_release_instances();
+}
+
+static uint64_t host_nanos(void) {
+  struct timespec ts;
+  timespec_get(&ts, TIME_UTC);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void transfer(uint32_t device, const uint8_t *data, uint32_t count) {
+  stub_i2c_transfer(device, data, count);
+  ingest_bytes += count;
+}
+
+static void send_commands(uint32_t device, const uint8_t *commands, uint32_t count) {
+  uint8_t buffer[32] = {0x00};
+  memcpy(&buffer[1], commands, count);
+  transfer(device, buffer, count + 1);
+}
+
+static void send_data(uint32_t device, const uint8_t *data, uint32_t count) {
+  uint8_t buffer[1 + 2048] = {0x40};
+  memcpy(&buffer[1], data, count);
+  transfer(device, buffer, count + 1);
+}
+
+// Reads display data (D/C=1) or the status byte (D/C=0) in a read transaction
+static void receive(uint32_t device, bool data, uint8_t *target, uint32_t count) {
+  const uint8_t control = data ? 0x40 : 0x00;
+  transfer(device, &control, 1);
+  stub_i2c_start(device, true);
+  for (uint32_t i = 0; i < count; i++) {
+    target[i] = stub_i2c_read(device);
+  }
+  stub_i2c_stop(device);
+  ingest_bytes += count;
+}
+
+static void fill_pattern(uint8_t *data, uint32_t count, uint32_t seed) {
+  for (uint32_t i = 0; i < count; i++) {
+    data[i] = (uint8_t)((i * 37) ^ (seed * 101) ^ (i >> 3));
+  }
+}
+
+// Page addressing, one transaction per page, the way Adafruit_SH110X sends a frame
+static void send_page_frame(uint32_t device, uint32_t seed) {
+  uint8_t data[128];
+  for (uint8_t page = 0; page < 16; page++) {
+    const uint8_t address[] = {0xb0 | page, 0x00, 0x10};
+    send_commands(device, address, sizeof(address));
+    fill_pattern(data, sizeof(data), seed + page);
+    send_data(device, data, sizeof(data));
+  }
+}
+
+static void setup_display_on(uint32_t device) {
+  const uint8_t init[] = {0xae, 0xd5, 0x51, 0x20, 0x81, 0x4f, 0xa0, 0xc0, 0xdc, 0x00, 0xa4, 0xa6, 0xaf};
+  send_commands(device, init, sizeof(init));
+}
+
+// Command traffic only: the init sequence again (as some drivers do on every frame), and
+// address sets that override each other
+static void frame_commands(uint32_t device, uint32_t index) {
+  setup_display_on(device);
+  const uint8_t address[] = {0xb0, 0xb1, 0xb2, 0xb3, 0x00, 0x02, 0x10, 0x11, 0x20, 0x20};
+  send_commands(device, address, sizeof(address));
+}
+
+static void frame_page_full(uint32_t device, uint32_t index) {
+  send_page_frame(device, index);
+}
+
+static void frame_page_unchanged(uint32_t device, uint32_t index) {
+  send_page_frame(device, 0);
+}
+
+static void setup_vertical(uint32_t device) {
+  setup_display_on(device);
+  const uint8_t mode[] = {0x21};
+  send_commands(device, mode, sizeof(mode));
+}
+
+static void frame_vertical_full(uint32_t device, uint32_t index) {
+  uint8_t data[2048];
+  const uint8_t address[] = {0xb0, 0x00, 0x10};
+  send_commands(device, address, sizeof(address));
+  fill_pattern(data, sizeof(data), index);
+  send_data(device, data, sizeof(data));
+}
+
+static void setup_scroll(uint32_t device) {
+  setup_display_on(device);
+  send_page_frame(device, 0);
+}
+
+static void frame_scroll(uint32_t device, uint32_t index) {
+  const uint8_t start_line[] = {0xdc, (index + 1) & 0x7f};
+  send_commands(device, start_line, sizeof(start_line));
+}
+
+// Brightness fade: only the palette changes, the rendered frame is recolored
+static void frame_contrast_fade(uint32_t device, uint32_t index) {
+  const uint8_t contrast[] = {0x81, (index + 1) & 0xff};
+  send_commands(device, contrast, sizeof(contrast));
+}
+
+// A status line: 30 columns of one page
+static void frame_partial(uint32_t device, uint32_t index) {
+  uint8_t data[30];
+  const uint8_t address[] = {0xb3, 0x08, 0x12};
+  send_commands(device, address, sizeof(address));
+  fill_pattern(data, sizeof(data), index);
+  send_data(device, data, sizeof(data));
+}
+
+// 64-row multiplex ratio on the 128-row panel, as Adafruit_SH110X configures 64x128 modules
+static void setup_multiplex_64(uint32_t device) {
+  setup_display_on(device);
+  const uint8_t multiplex[] = {0xa8, 0x3f, 0xd3, 0x60};
+  send_commands(device, multiplex, sizeof(multiplex));
+}
+
+// Sets one pixel in each of 8 columns, in read-modify-write mode: for each column a dummy
+// read, a data read, then the write of the modified byte
+static void frame_rmw_pixels(uint32_t device, uint32_t index) {
+  const uint8_t column = index * 8 % 128;
+  const uint8_t start[] = {0xb0 | (index / 16 % 16), column & 0xf, 0x10 | column >> 4, 0xe0};
+  send_commands(device, start, sizeof(start));
+  for (uint8_t i = 0; i < 8; i++) {
+    uint8_t value[2];
+    receive(device, true, value, 2);
+    value[1] ^= 1 << (index % 8);
+    send_data(device, &value[1], 1);
+  }
+  const uint8_t end[] = {0xee};
+  send_commands(device, end, sizeof(end));
+}
+
+// MCU memory sniffing: the chip reads the frame from the firmware's buffer, and ignores the
+// I2C data bytes that the firmware still sends
+#define MCU_DISPLAY_BUFFER 0x1000 // MCU address of the firmware's 2 KB buffer
+#define MCU_DISPLAY_POINTER 0x0100 // and of the pointer to it, in indirect mode
+
+static void configure_mcu_buffer(uint32_t device) {
+  stub_set_symbol("display_buffer", MCU_DISPLAY_BUFFER);
+  stub_set_attr_string("mcuBuffer", "display_buffer");
+}
+
+static void frame_mcu_buffer(uint32_t device, uint32_t index) {
+  uint8_t *buffer = stub_mcu_memory(MCU_DISPLAY_BUFFER);
+  for (uint8_t page = 0; page < 16; page++) {
+    fill_pattern(&buffer[page * 128], 128, index + page);
+  }
+  send_page_frame(device, index);
+}
+
+// Two displays on the same bus, at 0x3c and 0x3d
+static void configure_address(uint32_t device) {
+  stub_set_attr("address", 0x3c + device);
+}
+
+// Panel timing mode with the slowest clock (divide ratio 16, oscillator -25%): a frame
+// every ~400 ms of simulated time, instead of one per workload frame
+static void configure_panel_timing(uint32_t device) {
+  stub_set_attr("panelTiming", 1);
+}
+
+static void setup_slow_clock(uint32_t device) {
+  setup_display_on(device);
+  const uint8_t clock[] = {0xd5, 0x0f};
+  send_commands(device, clock, sizeof(clock));
+}
+
+static void setup_display_off(uint32_t device) {
+  setup_display_on(device);
+  const uint8_t off[] = {0xae};
+  send_commands(device, off, sizeof(off));
+}
+
+// Adaptive refresh: full frames streamed for 40 workload frames, which lowers the frame
+// rate, then 10 idle ones, after which it is back to the full rate
+static void configure_adaptive_refresh(uint32_t device) {
+  stub_set_attr("adaptiveRefresh", 1);
+}
+
+static void frame_adaptive_bursts(uint32_t device, uint32_t index) {
+  if (index % ADAPTIVE_BURST_FRAMES < ADAPTIVE_BURST_FRAMES - ADAPTIVE_IDLE_FRAMES) {
+    send_page_frame(device, index);
+  }
+}
+
+static const scenario_t scenarios[] = {
+    {"page-full", setup_display_on, frame_page_full},
+    {"page-unchanged", setup_display_on, frame_page_unchanged},
+    {"vertical-full", setup_vertical, frame_vertical_full},
+    {"scroll", setup_scroll, frame_scroll},
+    {"contrast-fade", setup_scroll, frame_contrast_fade},
+    {"partial", setup_display_on, frame_partial},
+    {"rmw-pixels", setup_scroll, frame_rmw_pixels},
+    {"display-off", setup_display_off, frame_page_full},
+    {"commands", setup_display_on, frame_commands},
+    {"page-full-64x128", setup_display_on, frame_page_full, 64, 128},
+    {"page-full-128x64", setup_display_on, frame_page_full, 128, 64},
+    {"page-full-mux64", setup_multiplex_64, frame_page_full},
+    {"mcu-buffer", setup_display_on, frame_mcu_buffer, 0, 0, configure_mcu_buffer},
+    {"dual-page-full", setup_display_on, frame_page_full, 0, 0, configure_address, 2},
+    {"panel-slow-clock", setup_slow_clock, frame_page_full, 0, 0, configure_panel_timing},
+    {"adaptive-bursts", setup_display_on, frame_adaptive_bursts, 0, 0, configure_adaptive_refresh},
+};
+_Static_assert(sizeof(scenarios) / sizeof(scenarios[0]) <= MAX_SCENARIOS, "raise MAX_SCENARIOS");
+
+static result_t run_scenario(const scenario_t *scenario, uint32_t frames) {
+  result_t result = {0};
+  const uint32_t instances = scenario->instances ? scenario->instances : 1;
+  restart();
+  stub_display_width = scenario->width ? scenario->width : 128;
+  stub_display_height = scenario->height ? scenario->height : 128;
+  stub_clear_attrs();
+  for (uint32_t device = 0; device < instances; device++) {
+    if (scenario->configure) {
+      scenario->configure(device);
+    }
+    chip_init();
+  }
+  for (uint32_t device = 0; device < instances; device++) {
+    scenario->setup(device);
+  }
+  stub_advance(FRAME_NANOS);
+  memset(&stub_counters, 0, sizeof(stub_counters));
+
+  for (uint32_t i = 0; i < frames; i++) {
+    ingest_bytes = 0;
+    uint64_t start = host_nanos();
+    for (uint32_t device = 0; device < instances; device++) {
+      scenario->frame(device, i);
+    }
+    result.ingest_nanos += host_nanos() - start;
+    result.ingest_bytes += ingest_bytes;
+
+    start = host_nanos();
+    stub_advance(FRAME_NANOS);
+    result.render_nanos += host_nanos() - start;
+  }
+  result.frames = frames;
+  result.host = stub_counters;
+  return result;
+}
+
+// Reads a whole file, followed by a terminating zero
+static uint8_t *read_file(const char *filename, uint32_t *length) {
+  FILE *file = fopen(filename, "rb");
+  if (!file) {
+    perror(filename);
+    exit(1);
+  }
+  fseek(file, 0, SEEK_END);
+  const long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  uint8_t *content = malloc(size + 1);
+  if (fread(content, 1, size, file) != (size_t)size) {
+    perror(filename);
+    exit(1);
+  }
+  fclose(file);
+  content[size] = 0;
+  *length = size;
+  return content;
+}
+
+// Finds the next line of one chip in a simulation log, after `content`: `prefix`, the I2C
+// address of the chip (2 hex digits) and ": ". Returns the hex data that follows, or NULL.
+// A negative `*address` selects the chip of the first line, and is set to its address.
+static const char *next_log_line(const char *content, const char *prefix, int *address) {
+  for (const char *line = strstr(content, prefix); line; line = strstr(line, prefix)) {
+    line += strlen(prefix);
+    unsigned line_address;
+    if (sscanf(line, "%2x", &line_address) != 1 || line[2] != ':' || line[3] != ' ') {
+      continue;
+    }
+    if (*address < 0) {
+      *address = line_address;
+    }
+    if ((int)line_address == *address) {
+      return line + 4;
+    }
+  }
+  return NULL;
+}
+
+// Loads an I2C trace recorded with the traceI2C attribute: either the raw binary stream,
+// or a simulation log with the hex-encoded "sh1107-trace <address>: " lines printed by the
+// chips. `*address` selects the chip, see next_log_line().
+static uint8_t *load_trace(const char *filename, int *address, uint32_t *length) {
+  uint32_t size;
+  uint8_t *content = read_file(filename, &size);
+  if (size >= 4 && !memcmp(content, TRACE_MAGIC, 4)) {
+    *length = size;
+    return content;
+  }
+
+  // Text log: decode the trace lines in place, the decoded bytes take less room than the hex
+  uint32_t count = 0;
+  for (char *line = (char *)next_log_line((char *)content, TRACE_LINE_PREFIX, address); line;
+       line = (char *)next_log_line(line, TRACE_LINE_PREFIX, address)) {
+    unsigned value;
+    while (sscanf(line, "%2x", &value) == 1 && line[0] != '\n' && line[1] != '\n') {
+      content[count++] = value;
+      line += 2;
+    }
+  }
+  *length = count;
+  return content;
+}
+
+static uint64_t read_varint(const uint8_t **cursor) {
+  uint64_t value = 0;
+  for (uint32_t shift = 0;; shift += 7) {
+    const uint8_t byte = *(*cursor)++;
+    value |= (uint64_t)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+
+// Replays a trace at full speed, on a fresh chip instance
+static result_t run_trace(const uint8_t *trace, uint32_t length) {
+  result_t result = {0};
+  restart();
+  chip_init();
+
+  if (length < 5 || memcmp(trace, TRACE_MAGIC, 4) || trace[4] != TRACE_VERSION) {
+    fprintf(stderr, "Not an SH1107 trace (version %d)\n", TRACE_VERSION);
+    exit(1);
+  }
+  const uint8_t *cursor = trace + 5;
+  const uint8_t *end = trace + length;
+  while (cursor < end) {
+    const uint8_t tag = *cursor++;
+    const uint64_t delta = read_varint(&cursor);
+    uint64_t start = host_nanos();
+    stub_advance(delta);
+    result.render_nanos += host_nanos() - start;
+
+    start = host_nanos();
+    switch (tag) {
+    case TRACE_START:
+      stub_i2c_start(0, *cursor & 1);
+      cursor++;
+      break;
+    case TRACE_STOP:
+      stub_i2c_stop(0);
+      break;
+    case TRACE_WRITE: {
+      const uint8_t count = *cursor++;
+      for (uint8_t i = 0; i < count; i++) {
+        stub_i2c_write(0, *cursor++);
+      }
+      result.ingest_bytes += count;
+      break;
+    }
+    case TRACE_READ:
+      stub_i2c_read(0);
+      result.ingest_bytes++;
+      break;
+    default:
+      fprintf(stderr, "Corrupt trace: unknown record %02x at offset %ld\n", tag, (long)(cursor - trace - 1));
+      exit(1);
+    }
+    result.ingest_nanos += host_nanos() - start;
+  }
+
+  const uint64_t start = host_nanos();
+  stub_advance(FRAME_NANOS);
+  result.render_nanos += host_nanos() - start;
+  result.host = stub_counters;
+  return result;
+}
+
+// FNV-1a of a GDDRAM image, to compare frames between runs
+static uint32_t gddram_hash(const uint8_t *pixels) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < 2048; i++) {
+    hash = (hash ^ pixels[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// Decodes the frames printed by a chip with the captureFrames attribute set (see
+// src/sh1107-capture.h) in a simulation log, for the chip selected by `*address` (see
+// next_log_line()). Prints one summary line per frame when `print` is set, and stores the
+// GDDRAM hashes of the first `max_hashes` frames.
+static uint32_t decode_capture(const char *content, int *address, bool print, uint32_t *hashes,
+                               uint32_t max_hashes) {
+  static uint8_t record[32 + 3 * 2048];
+  uint8_t pixels[2048] = {0};
+  uint64_t nanos = 0;
+  uint32_t frames = 0;
+  bool header = false;
+  for (const char *line = next_log_line(content, CAPTURE_LINE_PREFIX, address); line;
+       line = next_log_line(line, CAPTURE_LINE_PREFIX, address)) {
+    uint32_t length = 0;
+    unsigned value;
+    while (length < sizeof(record) && sscanf(line, "%2x", &value) == 1 && line[0] != '\n' && line[1] != '\n') {
+      record[length++] = value;
+      line += 2;
+    }
+
+    const uint8_t *cursor = record;
+    const uint8_t *end = record + length;
+    if (length >= 4 && record[0] == CAPTURE_HEADER) {
+      if (record[1] != CAPTURE_VERSION) {
+        fprintf(stderr, "Unsupported capture version %d\n", record[1]);
+        exit(1);
+      }
+      if (print) {
+        printf("capture of a %ux%u panel at 0x%02x\n", record[2], record[3], *address);
+      }
+      memset(pixels, 0, sizeof(pixels));
+      nanos = 0;
+      header = true;
+      continue;
+    }
+    if (!header || length < 2 + CAPTURE_SETTINGS_SIZE || *cursor++ != CAPTURE_FRAME) {
+      fprintf(stderr, "Corrupt capture record %u\n", frames);
+      exit(1);
+    }
+    nanos += read_varint(&cursor);
+    const uint8_t *settings = cursor;
+    cursor += CAPTURE_SETTINGS_SIZE;
+    uint32_t offset = 0;
+    uint32_t changed = 0;
+    while (cursor < end) {
+      offset += read_varint(&cursor);
+      if (offset >= sizeof(pixels)) {
+        break;
+      }
+      const uint32_t count = read_varint(&cursor);
+      for (uint32_t i = 0; i < count && offset < sizeof(pixels) && cursor < end; i++) {
+        pixels[offset++] ^= *cursor++;
+      }
+      changed += count;
+    }
+
+    const uint32_t hash = gddram_hash(pixels);
+    if (frames < max_hashes) {
+      hashes[frames] = hash;
+    }
+    const uint8_t flags = settings[CAPTURE_SETTINGS_FLAGS];
+    if (print) {
+      printf("frame %u at %.3f ms: %u bytes changed, gddram %08x, display %s%s%s, contrast %u, start line %u, "
+             "offset %u, multiplex %u\n",
+             frames, nanos / 1e6, changed, hash, flags & CAPTURE_FLAG_DISPLAY_ON ? "on" : "off",
+             flags & CAPTURE_FLAG_ALL_ON ? ", all on" : "", flags & CAPTURE_FLAG_INVERT ? ", inverted" : "",
+             settings[CAPTURE_SETTINGS_CONTRAST], settings[CAPTURE_SETTINGS_START_LINE],
+             settings[CAPTURE_SETTINGS_DISPLAY_OFFSET], settings[CAPTURE_SETTINGS_MULTIPLEX]);
+    }
+    frames++;
+  }
+  return frames;
+}
+
+static uint32_t run_capture(const char *filename, int address) {
+  uint32_t size;
+  char *content = (char *)read_file(filename, &size);
+  const uint32_t frames = decode_capture(content, &address, true, NULL, 0);
+  free(content);
+  return frames;
+}
+
+// Check mode: renders random GDDRAM contents with every combination of the display
+// settings, and compares the host framebuffer against the reference renderer.
+static const uint8_t check_x_offsets[] = {0, 1, 8, 31, 96, 127};
+static const uint32_t check_sizes[][2] = {{128, 128}, {64, 128}, {128, 64}, {72, 40}, {160, 144}};
+static const uint8_t check_start_lines[] = {0, 1, 7, 8, 63, 64, 100, 127};
+static const uint8_t check_multiplex_ratios[] = {127, 63, 31, 100};
+static const char *const check_colors[] = {NULL, "blue", "yellow", "#1f8040"};
+
+static uint32_t check_random_state = 1;
+
+static uint32_t check_random(void) {
+  // xorshift32
+  check_random_state ^= check_random_state << 13;
+  check_random_state ^= check_random_state >> 17;
+  check_random_state ^= check_random_state << 5;
+  return check_random_state;
+}
+
+// Panels larger than the GDDRAM show it in their top left corner, the other pixels stay
+// transparent
+static uint32_t check_compare(const char *setting) {
+  static uint32_t expected[128 * 128];
+  const uint32_t stride = stub_display_width;
+  const uint32_t width = stride < 128 ? stride : 128;
+  const uint32_t height = stub_display_height < 128 ? stub_display_height : 128;
+  const uint32_t *actual = stub_framebuffer(0);
+  sh1107_render_reference(stub_i2c_user_data(0), expected);
+  for (uint32_t y = 0; y < stub_display_height; y++) {
+    for (uint32_t x = 0; x < stride; x++) {
+      const uint32_t pixel = x < width && y < height ? expected[y * width + x] : 0;
+      if (actual[y * stride + x] != pixel) {
+        printf("Mismatch with %s at (%u, %u): %08x instead of %08x\n", setting, x, y, actual[y * stride + x], pixel);
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Rewrites a random span of one page, to exercise the dirty region tracking
+static void check_partial_write(uint32_t device) {
+  uint8_t data[128];
+  const uint8_t page = check_random() % 16;
+  const uint8_t column = check_random() % 128;
+  const uint8_t count = 1 + check_random() % (128 - column);
+  for (uint8_t i = 0; i < count; i++) {
+    data[i] = check_random();
+  }
+  const uint8_t address[] = {0xb0 | page, column & 0xf, 0x10 | column >> 4};
+  send_commands(device, address, sizeof(address));
+  send_data(device, data, count);
+}
+
+static uint32_t run_check(uint32_t rounds) {
+  uint32_t frames = 0;
+  uint32_t mismatches = 0;
+  char setting[224];
+  for (uint32_t round = 0; round < rounds; round++) {
+    const uint8_t x_offset = check_x_offsets[round % sizeof(check_x_offsets)];
+    const uint32_t *size = check_sizes[round / sizeof(check_x_offsets) % (sizeof(check_sizes) / sizeof(check_sizes[0]))];
+    restart();
+    stub_display_width = size[0];
+    stub_display_height = size[1];
+    stub_clear_attrs();
+    stub_set_attr("xOffset", x_offset);
+    const char *color = check_colors[round % (sizeof(check_colors) / sizeof(check_colors[0]))];
+    if (color) {
+      stub_set_attr_string("color", color);
+    }
+    chip_init();
+    setup_display_on(0);
+
+    uint8_t data[2048];
+    for (uint32_t i = 0; i < sizeof(data); i++) {
+      data[i] = check_random();
+    }
+    const uint8_t address[] = {0x21, 0xb0, 0x00, 0x10};
+    send_commands(0, address, sizeof(address));
+    send_data(0, data, sizeof(data));
+    const uint8_t page_mode[] = {0x20};
+    send_commands(0, page_mode, sizeof(page_mode));
+
+    for (uint32_t combination = 0; combination < 8 * sizeof(check_start_lines); combination++) {
+      const uint8_t invert = combination & 1;
+      const uint8_t remap = combination >> 1 & 1;
+      const uint8_t reverse = combination >> 2 & 1;
+      const uint8_t start_line = check_start_lines[combination >> 3];
+      const uint8_t multiplex = check_multiplex_ratios[(combination + round) % sizeof(check_multiplex_ratios)];
+      const uint8_t display_offset = round & 1 ? check_random() & 0x7f : 0;
+      const uint8_t contrast = check_random();
+      const uint8_t settings[] = {0xa6 | invert, 0xa0 | remap, reverse ? 0xc8 : 0xc0, 0xdc, start_line,
+                                  0xa8, multiplex, 0xd3, display_offset, 0x81, contrast};
+      send_commands(0, settings, sizeof(settings));
+      if (combination % 3 == 0) {
+        check_partial_write(0);
+      }
+      stub_advance(FRAME_NANOS);
+      const int length =
+          snprintf(setting, sizeof(setting),
+                   "%ux%u, color %s, x offset %u, invert %u, remap %u, COM reverse %u, multiplex %u, "
+                   "display offset %u, contrast %u",
+                   size[0], size[1], color ? color : "white", x_offset, invert, remap, reverse, multiplex,
+                   display_offset, contrast);
+      snprintf(setting + length, sizeof(setting) - length, ", start line %u", start_line);
+      mismatches += check_compare(setting);
+      frames++;
+
+      // Scroll with the same settings, which only re-sends the rendered rows
+      const uint8_t scroll[] = {combination & 8 ? 0xd3 : 0xdc, check_random() & 0x7f};
+      send_commands(0, scroll, sizeof(scroll));
+      stub_advance(FRAME_NANOS);
+      snprintf(setting + length, sizeof(setting) - length, ", %s scrolled to %u",
+               combination & 8 ? "display offset" : "start line", scroll[1]);
+      mismatches += check_compare(setting);
+      frames++;
+
+      // Palette change only, which recolors the rendered frame
+      const uint8_t palette[] = {0x81, check_random(), 0xa6 | !invert};
+      send_commands(0, palette, sizeof(palette));
+      stub_advance(FRAME_NANOS);
+      snprintf(setting + length, sizeof(setting) - length, ", then contrast %u, invert %u", palette[1], !invert);
+      mismatches += check_compare(setting);
+      frames++;
+    }
+
+    // Constant frames, and back to the GDDRAM content
+    static const struct {
+      uint8_t command;
+      const char *name;
+    } modes[] = {{0xa5, "entire display on"}, {0xa5, "entire display on, new contrast"},
+                 {0xa4, "entire display off"}, {0xae, "display off"}, {0xaf, "display on"}};
+    for (uint32_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+      const uint8_t commands[] = {modes[i].command, 0x81, check_random()};
+      send_commands(0, commands, sizeof(commands));
+      check_partial_write(0);
+      stub_advance(FRAME_NANOS);
+      snprintf(setting, sizeof(setting), "%ux%u, x offset %u, %s", size[0], size[1], x_offset, modes[i].name);
+      mismatches += check_compare(setting);
+      frames++;
+    }
+  }
+  printf("Reference check: %u frames compared, %u mismatches\n", frames, mismatches);
+  return mismatches;
+}
+
+static uint32_t check_bytes(const char *what, const uint8_t *actual, const uint8_t *expected, uint32_t count) {
+  for (uint32_t i = 0; i < count; i++) {
+    if (actual[i] != expected[i]) {
+      printf("Mismatch in %s at byte %u: %02x instead of %02x\n", what, i, actual[i], expected[i]);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// I2C reads: the status byte, display data read back through the dummy read, and the
+// column restored at the end of read-modify-write mode
+static uint32_t run_read_check(void) {
+  uint32_t mismatches = 0;
+  restart();
+  stub_display_width = 128;
+  stub_display_height = 128;
+  stub_clear_attrs();
+  chip_init();
+
+  uint8_t status;
+  const uint8_t display_off = 0x40;
+  receive(0, false, &status, 1);
+  mismatches += check_bytes("status, display off", &status, &display_off, 1);
+  setup_display_on(0);
+  const uint8_t display_on = 0x00;
+  receive(0, false, &status, 1);
+  mismatches += check_bytes("status, display on", &status, &display_on, 1);
+
+  const uint8_t address[] = {0xb2, 0x04, 0x11};
+  const uint8_t data[] = {0x11, 0x22, 0x33, 0x44, 0x55};
+  send_commands(0, address, sizeof(address));
+  send_data(0, data, sizeof(data));
+  send_commands(0, address, sizeof(address));
+  uint8_t values[1 + sizeof(data)];
+  receive(0, true, values, sizeof(values));
+  mismatches += check_bytes("data read", &values[1], data, sizeof(data));
+
+  // Sets the top bit of 3 bytes: reads leave the column alone, and 0xee moves it back to
+  // the column of 0xe0, so reading again starts at the first modified byte
+  const uint8_t rmw_start[] = {0xb2, 0x04, 0x11, 0xe0};
+  send_commands(0, rmw_start, sizeof(rmw_start));
+  for (uint8_t i = 0; i < 3; i++) {
+    uint8_t value[2];
+    receive(0, true, value, 2);
+    value[1] |= 0x80;
+    send_data(0, &value[1], 1);
+  }
+  const uint8_t rmw_end[] = {0xee};
+  send_commands(0, rmw_end, sizeof(rmw_end));
+  const uint8_t modified[] = {0x91, 0xa2, 0xb3, 0x44, 0x55};
+  receive(0, true, values, sizeof(values));
+  mismatches += check_bytes("data read after read-modify-write", &values[1], modified, sizeof(modified));
+
+  printf("Read check: %u mismatches\n", mismatches);
+  return mismatches;
+}
+
+// Indirect MCU buffers (mcuBufferIndirect), with 2 and 4 byte pointers: the chip follows
+// the pointer once it is set, and ignores the bytes past a 2 byte one. The GDDRAM is read
+// back through I2C.
+static uint32_t run_mcu_check(void) {
+  uint32_t mismatches = 0;
+  for (uint32_t pointer_size = 2; pointer_size <= 4; pointer_size += 2) {
+    restart();
+    stub_display_width = 128;
+    stub_display_height = 128;
+    stub_clear_attrs();
+    stub_set_symbol("display_pointer", MCU_DISPLAY_POINTER);
+    stub_set_attr_string("mcuBuffer", "display_pointer");
+    stub_set_attr("mcuBufferIndirect", 1);
+    stub_set_attr("mcuBufferPointerSize", pointer_size);
+    chip_init();
+    setup_display_on(0);
+    stub_advance(FRAME_NANOS);
+
+    // Like Adafruit_SH110X::begin(): the buffer is filled before its pointer is stored
+    uint8_t *buffer = stub_mcu_memory(MCU_DISPLAY_BUFFER);
+    for (uint8_t page = 0; page < 16; page++) {
+      fill_pattern(&buffer[page * 128], 128, page + pointer_size);
+    }
+    uint8_t *pointer = stub_mcu_memory(MCU_DISPLAY_POINTER);
+    memset(pointer, 0xa5, 4);
+    pointer[0] = MCU_DISPLAY_BUFFER & 0xff;
+    pointer[1] = MCU_DISPLAY_BUFFER >> 8;
+    if (pointer_size == 4) {
+      pointer[2] = pointer[3] = 0;
+    }
+    stub_advance(FRAME_NANOS);
+
+    char what[64];
+    for (uint8_t page = 0; page < 16; page++) {
+      const uint8_t address[] = {0xb0 | page, 0x00, 0x10};
+      uint8_t values[1 + 128];
+      send_commands(0, address, sizeof(address));
+      receive(0, true, values, sizeof(values));
+      snprintf(what, sizeof(what), "page %u of the %u byte pointer buffer", page, pointer_size);
+      mismatches += check_bytes(what, &values[1], &buffer[page * 128], 128);
+    }
+    snprintf(what, sizeof(what), "the %u byte pointer buffer", pointer_size);
+    mismatches += check_compare(what);
+  }
+  printf("MCU buffer check: %u mismatches\n", mismatches);
+  return mismatches;
+}
+
+// Records a workload on two displays (0x3c and 0x3d) with the traceI2C attribute, with
+// the trace lines printed to a temporary file, then replays the trace of each display on
+// a fresh chip: it must render the same frames. The workload ends with a small update,
+// in the partially filled trace buffer.
+static uint32_t run_trace_check(void) {
+  restart();
+  stub_display_width = 128;
+  stub_display_height = 128;
+  stub_clear_attrs();
+  for (uint32_t device = 0; device < 2; device++) {
+    configure_address(device);
+    stub_set_attr("traceI2C", 1);
+    chip_init();
+  }
+
+  const char *filename = stub_console_begin();
+  for (uint32_t device = 0; device < 2; device++) {
+    setup_display_on(device);
+  }
+  for (uint32_t i = 0; i < 40; i++) {
+    for (uint32_t device = 0; device < 2; device++) {
+      const uint32_t index = i + device * 7;
+      switch (index % 4) {
+      case 0:
+        frame_page_full(device, index);
+        break;
+      case 1:
+        frame_partial(device, index);
+        break;
+      case 2:
+        frame_rmw_pixels(device, index);
+        break;
+      default:
+        frame_scroll(device, index);
+        break;
+      }
+    }
+    stub_advance(check_random() % (2 * FRAME_NANOS));
+  }
+  frame_partial(0, 0);
+  stub_advance(10000000000ULL);
+  stub_console_end();
+
+  static uint32_t recorded[2][128 * 128];
+  for (uint32_t device = 0; device < 2; device++) {
+    memcpy(recorded[device], stub_framebuffer(device), sizeof(recorded[device]));
+  }
+  const stub_counters_t recorded_counters = stub_counters;
+
+  // Each display on its own: the frame counts of the two cannot be added up, as frames of
+  // both displays may be written at the same simulated time
+  uint32_t mismatches = 0;
+  uint32_t length = 0;
+  uint32_t buffer_writes = 0;
+  uint64_t buffer_bytes = 0;
+  stub_clear_attrs();
+  for (uint32_t device = 0; device < 2; device++) {
+    int address = 0x3c + device;
+    uint32_t stream_length;
+    uint8_t *trace = load_trace(filename, &address, &stream_length);
+    run_trace(trace, stream_length);
+    free(trace);
+    length += stream_length;
+    buffer_writes += stub_counters.buffer_writes;
+    buffer_bytes += stub_counters.buffer_bytes;
+    if (memcmp(recorded[device], stub_framebuffer(0), sizeof(recorded[device]))) {
+      printf("Mismatch in the replayed framebuffer of the display at 0x%02x\n", address);
+      mismatches++;
+    }
+  }
+  remove(filename);
+  if (buffer_writes != recorded_counters.buffer_writes || buffer_bytes != recorded_counters.buffer_bytes) {
+    printf("Mismatch in the replayed host counters: %u writes, %llu bytes instead of %u, %llu\n", buffer_writes,
+           (unsigned long long)buffer_bytes, recorded_counters.buffer_writes,
+           (unsigned long long)recorded_counters.buffer_bytes);
+    mismatches++;
+  }
+  printf("Trace check: %u bytes recorded and replayed, %u mismatches\n", length, mismatches);
+  return mismatches;
+}
+
+// Frame capture with the update timer firing in the middle of a data burst: the captured
+// frame has the bytes written so far, which the XOR delta must include. A second display,
+// at 0x3d, shows one frame: its capture lines are interleaved with those of the first one.
+static uint32_t run_capture_check(void) {
+  restart();
+  stub_display_width = 128;
+  stub_display_height = 128;
+  stub_clear_attrs();
+  for (uint32_t device = 0; device < 2; device++) {
+    configure_address(device);
+    stub_set_attr("captureFrames", 1);
+    chip_init();
+  }
+  const char *filename = stub_console_begin();
+
+  uint8_t gddram[2048] = {0};
+  uint32_t expected[3];
+  setup_display_on(0);
+  uint8_t second_gddram[2048];
+  setup_display_on(1);
+  send_page_frame(1, 3);
+  for (uint8_t page = 0; page < 16; page++) {
+    fill_pattern(&second_gddram[page * 128], 128, 3 + page);
+  }
+  stub_advance(FRAME_NANOS);
+  expected[0] = gddram_hash(gddram);
+
+  const uint8_t page0[] = {0xb0, 0x00, 0x10};
+  send_commands(0, page0, sizeof(page0));
+  fill_pattern(gddram, 128, 1);
+  send_data(0, gddram, 128);
+  const uint8_t page5[] = {0xb5, 0x00, 0x10};
+  send_commands(0, page5, sizeof(page5));
+  fill_pattern(&gddram[5 * 128], 128, 2);
+  stub_i2c_start(0, false);
+  stub_i2c_write(0, 0x40);
+  for (uint32_t i = 0; i < 128; i++) {
+    stub_i2c_write(0, gddram[5 * 128 + i]);
+    if (i == 63) {
+      // The update timer fires, the burst is still open
+      uint8_t written[2048];
+      memcpy(written, gddram, sizeof(written));
+      memset(&written[5 * 128 + 64], 0, 64);
+      stub_advance(FRAME_NANOS);
+      expected[1] = gddram_hash(written);
+    }
+  }
+  stub_i2c_stop(0);
+  stub_advance(FRAME_NANOS);
+  expected[2] = gddram_hash(gddram);
+  stub_advance(2000000000ULL);
+  stub_console_end();
+
+  uint32_t size;
+  char *content = (char *)read_file(filename, &size);
+  remove(filename);
+  int address = 0x3c;
+  uint32_t hashes[3] = {0};
+  const uint32_t frames = decode_capture(content, &address, false, hashes, 3);
+  address = 0x3d;
+  uint32_t second_hash = 0;
+  const uint32_t second_frames = decode_capture(content, &address, false, &second_hash, 1);
+  free(content);
+
+  uint32_t mismatches = (frames != 3) + (second_frames != 1);
+  for (uint32_t i = 0; i < 3; i++) {
+    if (hashes[i] != expected[i]) {
+      printf("Mismatch in captured frame %u: gddram %08x instead of %08x\n", i, hashes[i], expected[i]);
+      mismatches++;
+    }
+  }
+  if (second_hash != gddram_hash(second_gddram)) {
+    printf("Mismatch in the frame captured at 0x3d: gddram %08x instead of %08x\n", second_hash,
+           gddram_hash(second_gddram));
+    mismatches++;
+  }
+  printf("Capture check: %u + %u frames decoded, %u mismatches\n", frames, second_frames, mismatches);
+  return mismatches;
+}
+
+// Simulated time from a change until the chip renders it, in 1 ms steps
+static uint32_t render_latency_ms(void) {
+  const uint32_t frames = stub_counters.frames;
+  uint32_t latency = 0;
+  while (stub_counters.frames == frames && latency < 1000) {
+    stub_advance(1000000);
+    latency++;
+  }
+  return latency;
+}
+
+// Adaptive refresh: streaming full frames lowers the frame rate down to 1/4, and the
+// first change after an idle period is rendered at the full rate again
+static uint32_t run_adaptive_check(void) {
+  restart();
+  stub_display_width = 128;
+  stub_display_height = 128;
+  stub_clear_attrs();
+  configure_adaptive_refresh(0);
+  chip_init();
+  setup_display_on(0);
+  const uint32_t first_latency = render_latency_ms();
+
+  const uint32_t streamed = ADAPTIVE_BURST_FRAMES - ADAPTIVE_IDLE_FRAMES;
+  const uint32_t frames = stub_counters.frames;
+  for (uint32_t i = 0; i < streamed; i++) {
+    frame_adaptive_bursts(0, i);
+    stub_advance(FRAME_NANOS);
+  }
+  const uint32_t rendered = stub_counters.frames - frames;
+
+  stub_advance(ADAPTIVE_IDLE_FRAMES * FRAME_NANOS);
+  frame_partial(0, 0);
+  const uint32_t idle_latency = render_latency_ms();
+
+  const uint32_t mismatches = (rendered > streamed / 3) + (idle_latency > first_latency);
+  printf("Adaptive refresh check: %u of %u streamed frames rendered, rendered after %u ms when idle (%u ms at first), "
+         "%u mismatches\n",
+         rendered, streamed, idle_latency, first_latency, mismatches);
+  return mismatches;
+}
+
+// Number of frames rendered for changes streamed 2 ms apart, well within the refresh interval
+static uint32_t streamed_frames(uint32_t changes) {
+  const uint32_t frames = stub_counters.frames;
+  for (uint32_t i = 0; i < changes; i++) {
+    stub_advance(2000000);
+    frame_partial(0, i + 1);
+  }
+  return stub_counters.frames - frames;
+}
+
+// lowLatency and refreshInterval = 0 render at the end of the I2C transaction: the host
+// framebuffer is written before the simulated clock moves on. With lowLatency, only the
+// first change after an idle period is: the ones streamed after it are coalesced.
+static uint32_t run_latency_check(void) {
+  const uint32_t changes = 20;
+  uint32_t mismatches = 0;
+  uint32_t rendered[2];
+  for (uint32_t mode = 0; mode < 2; mode++) {
+    const char *setting = mode ? "refreshInterval 0" : "lowLatency";
+    restart();
+    stub_display_width = 128;
+    stub_display_height = 128;
+    stub_clear_attrs();
+    stub_set_attr(mode ? "refreshInterval" : "lowLatency", mode ? 0 : 1);
+    chip_init();
+    setup_display_on(0);
+    stub_advance(10 * FRAME_NANOS);
+
+    const uint32_t writes = stub_counters.buffer_writes;
+    frame_partial(0, 0);
+    if (stub_counters.buffer_writes == writes) {
+      printf("%s: the first change after an idle period was not rendered at the end of its transaction\n", setting);
+      mismatches++;
+    }
+    mismatches += check_compare(setting);
+    rendered[mode] = streamed_frames(changes);
+    stub_advance(FRAME_NANOS);
+    mismatches += check_compare(setting);
+  }
+  mismatches += (rendered[0] > changes / 4) + (rendered[1] != changes);
+  printf("Latency check: %u of %u streamed changes rendered with lowLatency, %u with refreshInterval 0, "
+         "%u mismatches\n",
+         rendered[0], changes, rendered[1], mismatches);
+  return mismatches;
+}
+
+static metrics_t get_metrics(const char *name, const result_t *result) {
+  metrics_t metrics = {{0}};
+  const uint32_t frames = result->frames ? result->frames : 1;
+  snprintf(metrics.name, sizeof(metrics.name), "%s", name);
+  metrics.ingest_ns_per_byte = result->ingest_bytes ? (double)result->ingest_nanos / result->ingest_bytes : 0.0;
+  metrics.render_ns_per_frame = (double)result->render_nanos / frames;
+  metrics.writes_per_frame = (double)result->host.buffer_writes / frames;
+  metrics.bytes_per_frame = (double)result->host.buffer_bytes / frames;
+  return metrics;
+}
+
+static void print_header(void) {
+  printf("%-16s %14s %16s %13s %13s\n", "scenario", "ingest ns/byte", "render ns/frame", "writes/frame",
+         "bytes/frame");
+}
+
+static void print_metrics(const metrics_t *metrics) {
+  printf("%-16s %14.2f %16.0f %13.2f %13.0f\n", metrics->name, metrics->ingest_ns_per_byte,
+         metrics->render_ns_per_frame, metrics->writes_per_frame, metrics->bytes_per_frame);
+}
+
+// Results file: comment lines, including the number of frames of each scenario run,
+// then one line per scenario with its name and the four metrics, separated by spaces
+static void write_results(const char *filename, const metrics_t *metrics, uint32_t count, uint32_t frames) {
+  FILE *file = fopen(filename, "w");
+  if (!file) {
+    perror(filename);
+    exit(1);
+  }
+  fprintf(file, "# frames %u\n", frames);
+  fprintf(file, "# scenario ingest_ns_per_byte render_ns_per_frame writes_per_frame bytes_per_frame\n");
+  for (uint32_t i = 0; i < count; i++) {
+    fprintf(file, "%s %.2f %.0f %.2f %.0f\n", metrics[i].name, metrics[i].ingest_ns_per_byte,
+            metrics[i].render_ns_per_frame, metrics[i].writes_per_frame, metrics[i].bytes_per_frame);
+  }
+  fclose(file);
+}
+
+static uint32_t read_results(const char *filename, metrics_t *metrics, uint32_t max_count, uint32_t *frames) {
+  FILE *file = fopen(filename, "r");
+  if (!file) {
+    perror(filename);
+    exit(1);
+  }
+  char line[256];
+  uint32_t count = 0;
+  *frames = 0;
+  while (count < max_count && fgets(line, sizeof(line), file)) {
+    metrics_t *entry = &metrics[count];
+    if (sscanf(line, "# frames %u", frames) == 1 || line[0] == '#' || sscanf(line, "%31s %lf %lf %lf %lf", entry->name, &entry->ingest_ns_per_byte,
+                                 &entry->render_ns_per_frame, &entry->writes_per_frame,
+                                 &entry->bytes_per_frame) != 5) {
+      continue;
+    }
+    count++;
+  }
+  fclose(file);
+  return count;
+}
+
+// A timing regresses when it is more than `threshold` percent, and more than the noise
+// floor, above the baseline. The host traffic is deterministic: any increase is a regression.
+static bool timing_regressed(double value, double baseline, double threshold, double noise) {
+  return value > baseline * (1 + threshold / 100) && value - baseline > noise;
+}
+
+static bool traffic_regressed(double value, double baseline) {
+  return value > baseline * 1.001 + 0.005;
+}
+
+// Compares the results against a baseline file, and returns the number of regressed scenarios
+static uint32_t compare_results(const char *filename, const metrics_t *metrics, uint32_t count, uint32_t frames,
+                                double threshold, bool report) {
+  metrics_t baseline[MAX_SCENARIOS];
+  uint32_t baseline_frames;
+  const uint32_t baseline_count = read_results(filename, baseline, MAX_SCENARIOS, &baseline_frames);
+  uint32_t regressions = 0;
+  if (report) {
+    printf("\nComparison with %s (threshold %.0f%%):\n", filename, threshold);
+  }
+  if (report && baseline_frames != frames) {
+    printf("Warning: the baseline ran %u frames per scenario, not %u: the per-frame figures may differ\n",
+           baseline_frames, frames);
+  }
+  if (report) {
+    printf("%-16s %14s %16s %13s %13s\n", "scenario", "ingest", "render", "writes", "bytes");
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    const metrics_t *current = &metrics[i];
+    const metrics_t *base = NULL;
+    for (uint32_t j = 0; j < baseline_count; j++) {
+      if (!strcmp(baseline[j].name, current->name)) {
+        base = &baseline[j];
+      }
+    }
+    if (!base) {
+      if (report) {
+        printf("%-16s %14s\n", current->name, "new");
+      }
+      continue;
+    }
+    const bool ingest = timing_regressed(current->ingest_ns_per_byte, base->ingest_ns_per_byte, threshold,
+                                         MIN_INGEST_REGRESSION);
+    const bool render = timing_regressed(current->render_ns_per_frame, base->render_ns_per_frame, threshold,
+                                         MIN_RENDER_REGRESSION);
+    const bool writes = traffic_regressed(current->writes_per_frame, base->writes_per_frame);
+    const bool bytes = traffic_regressed(current->bytes_per_frame, base->bytes_per_frame);
+    // Ratio to the baseline, or the value itself when the baseline is 0
+    const double values[4][2] = {
+        {current->ingest_ns_per_byte, base->ingest_ns_per_byte},
+        {current->render_ns_per_frame, base->render_ns_per_frame},
+        {current->writes_per_frame, base->writes_per_frame},
+        {current->bytes_per_frame, base->bytes_per_frame},
+    };
+    const bool regressed[4] = {ingest, render, writes, bytes};
+    char columns[4][24];
+    for (uint32_t k = 0; k < 4; k++) {
+      const char *flag = regressed[k] ? "REGRESSED " : "";
+      if (values[k][1]) {
+        snprintf(columns[k], sizeof(columns[k]), "%s%.2fx", flag, values[k][0] / values[k][1]);
+      } else {
+        snprintf(columns[k], sizeof(columns[k]), "%s%.2f", flag, values[k][0]);
+      }
+    }
+    if (report) {
+      printf("%-16s %14s %16s %13s %13s\n", current->name, columns[0], columns[1], columns[2], columns[3]);
+    }
+    if (ingest || render || writes || bytes) {
+      regressions++;
+    }
+  }
+  if (report) {
+    printf("%u of %u scenarios regressed\n", regressions, count);
+  }
+  return regressions;
+}
+
+// Runs the whole suite REPEATS times, rather than each scenario in a row, so that a slow
+// period of the host does not hit all the runs of a scenario. `best` keeps the fastest
+// timings of each scenario, over this call and the previous ones unless `first` is set.
+static void run_suite(uint32_t frames, result_t *best, bool first) {
+  const uint32_t count = sizeof(scenarios) / sizeof(scenarios[0]);
+  for (uint32_t repeat = 0; repeat < REPEATS; repeat++) {
+    for (uint32_t i = 0; i < count; i++) {
+      const result_t result = run_scenario(&scenarios[i], frames);
+      if (first && !repeat) {
+        best[i] = result;
+      }
+      best[i].ingest_nanos = result.ingest_nanos < best[i].ingest_nanos ? result.ingest_nanos : best[i].ingest_nanos;
+      best[i].render_nanos = result.render_nanos < best[i].render_nanos ? result.render_nanos : best[i].render_nanos;
+    }
+  }
+}
+
+static void get_suite_metrics(const result_t *results, metrics_t *metrics) {
+  for (uint32_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+    metrics[i] = get_metrics(scenarios[i].name, &results[i]);
+  }
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [frames] [--results <file>] [--compare <baseline file>] [--threshold <percent>]\n"
+          "       %s --replay <trace file> [address]\n       %s --capture <log file> [address]\n"
+          "       %s --check [rounds]\n",
+          program, program, program, program);
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc > 1 && !strcmp(argv[1], "--check")) {
+    const uint32_t rounds = argc > 2 ? atoi(argv[2]) : DEFAULT_CHECK_ROUNDS;
+    if (!rounds) {
+      usage(argv[0]);
+    }
+    const uint32_t mismatches = run_check(rounds) + run_read_check() + run_mcu_check() + run_trace_check() + run_capture_check() +
+                                 run_adaptive_check() + run_latency_check();
+    return mismatches ? 1 : 0;
+  }
+  // The chip to decode in a log with several displays, by I2C address (hex): the first one by default
+  int address = argc == 4 ? (int)strtol(argv[3], NULL, 16) : -1;
+  if (argc > 1 && !strcmp(argv[1], "--capture")) {
+    if (argc != 3 && argc != 4) {
+      usage(argv[0]);
+    }
+    printf("%u frames\n", run_capture(argv[2], address));
+    return 0;
+  }
+  if (argc > 1 && !strcmp(argv[1], "--replay")) {
+    if (argc != 3 && argc != 4) {
+      usage(argv[0]);
+    }
+    uint32_t length;
+    uint8_t *trace = load_trace(argv[2], &address, &length);
+    result_t result = run_trace(trace, length);
+    free(trace);
+    result.frames = result.host.frames;
+    if (address >= 0) {
+      printf("Replayed the trace of the display at 0x%02x\n", address);
+    }
+    print_header();
+    const metrics_t metrics = get_metrics("replay", &result);
+    print_metrics(&metrics);
+    return 0;
+  }
+
+  uint32_t frames = DEFAULT_FRAMES;
+  const char *results_file = NULL;
+  const char *baseline_file = NULL;
+  double threshold = DEFAULT_THRESHOLD;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--results") && i + 1 < argc) {
+      results_file = argv[++i];
+    } else if (!strcmp(argv[i], "--compare") && i + 1 < argc) {
+      baseline_file = argv[++i];
+    } else if (!strcmp(argv[i], "--threshold") && i + 1 < argc) {
+      threshold = atof(argv[++i]);
+    } else if (!(frames = atoi(argv[i]))) {
+      usage(argv[0]);
+    }
+  }
+
+  const uint32_t count = sizeof(scenarios) / sizeof(scenarios[0]);
+  result_t best[MAX_SCENARIOS];
+  metrics_t metrics[MAX_SCENARIOS];
+  run_suite(frames, best, true);
+  get_suite_metrics(best, metrics);
+  for (uint32_t attempt = 1;
+       baseline_file && attempt < COMPARE_ATTEMPTS && compare_results(baseline_file, metrics, count, frames, threshold, false);
+       attempt++) {
+    printf("Regressions found, running the suite again to rule out host noise\n");
+    run_suite(frames, best, false);
+    get_suite_metrics(best, metrics);
+  }
+  print_header();
+  for (uint32_t i = 0; i < count; i++) {
+    print_metrics(&metrics[i]);
+  }
+  if (results_file) {
+    write_results(results_file, metrics, count, frames);
+  }
+  if (baseline_file && compare_results(baseline_file, metrics, count, frames, threshold, true)) {
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,342 @@
+// Native stand-in for the Wokwi simulator, used by the benchmark harness.
+//
+// SPDX-License-Identifier: MIT
+// Copyright (C) 2024 Uri Shaked / wokwi.com
+
+#define _POSIX_C_SOURCE 200809L // dup(), mkstemp()
+
+#include "wokwi-stub.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STUB_MAX_TIMERS 32
+#define STUB_MAX_ATTRS 32
+#define STUB_MAX_SYMBOLS 8
+
+typedef struct {
+  timer_config_t config;
+  bool armed;
+  bool repeat;
+  uint64_t deadline;
+  uint64_t period;
+} stub_timer_t;
+
+typedef struct {
+  const char *name;
+  uint32_t value;
+  const char *string;
+} stub_attr_t;
+
+typedef struct {
+  const char *name;
+  uint32_t address;
+} stub_symbol_t;
+
+stub_counters_t stub_counters;
+uint32_t stub_display_width = 128;
+uint32_t stub_display_height = 128;
+
+static uint64_t sim_nanos;
+static uint64_t last_write_nanos;
+static i2c_config_t devices[STUB_MAX_DEVICES];
+static uint32_t device_count;
+static stub_timer_t timers[STUB_MAX_TIMERS];
+static uint32_t timer_count;
+static uint32_t *framebuffers[STUB_MAX_DEVICES];
+static uint32_t framebuffer_count;
+static stub_attr_t attrs[STUB_MAX_ATTRS];
+static uint32_t attr_count;
+static stub_attr_t attr_values[STUB_MAX_ATTRS * STUB_MAX_DEVICES];
+static uint32_t attr_value_count;
+static stub_symbol_t symbols[STUB_MAX_SYMBOLS];
+static uint32_t symbol_count;
+static uint8_t mcu_memory[STUB_MCU_MEMORY_SIZE];
+static char console_filename[] = "/tmp/sh1107-console-XXXXXX";
+static int console_saved_stdout = -1;
+
+void stub_set_attr(const char *name, uint32_t value) {
+  for (uint32_t i = 0; i < attr_count; i++) {
+    if (!strcmp(attrs[i].name, name)) {
+      attrs[i].value = value;
+      return;
+    }
+  }
+  attrs[attr_count++] = (stub_attr_t){.name = name, .value = value};
+}
+
+void stub_set_attr_string(const char *name, const char *value) {
+  for (uint32_t i = 0; i < attr_count; i++) {
+    if (!strcmp(attrs[i].name, name)) {
+      attrs[i].string = value;
+      return;
+    }
+  }
+  attrs[attr_count++] = (stub_attr_t){.name = name, .string = value};
+}
+
+void stub_set_symbol(const char *name, uint32_t address) {
+  symbols[symbol_count++] = (stub_symbol_t){.name = name, .address = address};
+}
+
+uint8_t *stub_mcu_memory(uint32_t address) {
+  if (address >= STUB_MCU_MEMORY_SIZE) {
+    fprintf(stderr, "stub: MCU address %x out of bounds\n", address);
+    exit(1);
+  }
+  return &mcu_memory[address];
+}
+
+void stub_clear_attrs(void) {
+  attr_count = 0;
+}
+
+void stub_reset(void) {
+  for (uint32_t i = 0; i < framebuffer_count; i++) {
+    free(framebuffers[i]);
+  }
+  device_count = 0;
+  timer_count = 0;
+  framebuffer_count = 0;
+  symbol_count = 0;
+  memset(mcu_memory, 0, sizeof(mcu_memory));
+  attr_value_count = 0;
+  sim_nanos = 0;
+  memset(&stub_counters, 0, sizeof(stub_counters));
+}
+
+uint32_t stub_device_count(void) {
+  return device_count;
+}
+
+void *stub_i2c_user_data(uint32_t device) {
+  return devices[device].user_data;
+}
+
+void stub_i2c_start(uint32_t device, bool read) {
+  devices[device].connect(devices[device].user_data, devices[device].address, read);
+}
+
+void stub_i2c_write(uint32_t device, uint8_t value) {
+  devices[device].write(devices[device].user_data, value);
+}
+
+uint8_t stub_i2c_read(uint32_t device) {
+  return devices[device].read(devices[device].user_data);
+}
+
+void stub_i2c_stop(uint32_t device) {
+  if (devices[device].disconnect) {
+    devices[device].disconnect(devices[device].user_data);
+  }
+}
+
+void stub_i2c_transfer(uint32_t device, const uint8_t *data, uint32_t count) {
+  const i2c_config_t *config = &devices[device];
+  config->connect(config->user_data, config->address, false);
+  for (uint32_t i = 0; i < count; i++) {
+    config->write(config->user_data, data[i]);
+  }
+  if (config->disconnect) {
+    config->disconnect(config->user_data);
+  }
+}
+
+void stub_advance(uint64_t nanos) {
+  const uint64_t end = sim_nanos + nanos;
+  for (;;) {
+    stub_timer_t *next = NULL;
+    for (uint32_t i = 0; i < timer_count; i++) {
+      if (timers[i].armed && timers[i].deadline <= end && (!next || timers[i].deadline < next->deadline)) {
+        next = &timers[i];
+      }
+    }
+    if (!next) {
+      break;
+    }
+    if (next->deadline > sim_nanos) {
+      sim_nanos = next->deadline;
+    }
+    if (next->repeat) {
+      next->deadline += next->period ? next->period : 1;
+    } else {
+      next->armed = false;
+    }
+    next->config.callback(next->config.user_data);
+  }
+  sim_nanos = end;
+}
+
+uint64_t stub_now(void) {
+  return sim_nanos;
+}
+
+const uint32_t *stub_framebuffer(uint32_t index) {
+  return framebuffers[index];
+}
+
+const char *stub_console_begin(void) {
+  strcpy(console_filename + strlen(console_filename) - 6, "XXXXXX");
+  const int console = mkstemp(console_filename);
+  if (console < 0) {
+    perror(console_filename);
+    exit(1);
+  }
+  fflush(stdout);
+  console_saved_stdout = dup(STDOUT_FILENO);
+  dup2(console, STDOUT_FILENO);
+  close(console);
+  return console_filename;
+}
+
+void stub_console_end(void) {
+  fflush(stdout);
+  dup2(console_saved_stdout, STDOUT_FILENO);
+  close(console_saved_stdout);
+  console_saved_stdout = -1;
+}
+
+// Wokwi API implementation
+
+pin_t pin_init(const char *name, uint32_t mode) {
+  return 0;
+}
+
+uint32_t pin_read(pin_t pin) {
+  return LOW;
+}
+
+void pin_write(pin_t pin, uint32_t value) {
+}
+
+i2c_dev_t i2c_init(const i2c_config_t *config) {
+  if (device_count >= STUB_MAX_DEVICES) {
+    fprintf(stderr, "stub: too many I2C devices\n");
+    exit(1);
+  }
+  devices[device_count] = *config;
+  return device_count++;
+}
+
+timer_t timer_init(const timer_config_t *config) {
+  if (timer_count >= STUB_MAX_TIMERS) {
+    fprintf(stderr, "stub: too many timers\n");
+    exit(1);
+  }
+  timers[timer_count] = (stub_timer_t){.config = *config};
+  return timer_count++;
+}
+
+void timer_start(const timer_t timer, uint32_t micros, bool repeat) {
+  timer_start_ns_d(timer, micros * 1000.0, repeat);
+}
+
+void timer_start_ns_d(const timer_t timer, double nanos, bool repeat) {
+  timers[timer].armed = true;
+  timers[timer].repeat = repeat;
+  timers[timer].period = (uint64_t)nanos;
+  timers[timer].deadline = sim_nanos + (uint64_t)nanos;
+}
+
+void timer_stop(const timer_t timer) {
+  timers[timer].armed = false;
+}
+
+double get_sim_nanos_d(void) {
+  return (double)sim_nanos;
+}
+
+buffer_t framebuffer_init(uint32_t *pixel_width, uint32_t *pixel_height) {
+  *pixel_width = stub_display_width;
+  *pixel_height = stub_display_height;
+  framebuffers[framebuffer_count] = calloc(stub_display_width * stub_display_height, sizeof(uint32_t));
+  return framebuffer_count++;
+}
+
+void buffer_read(buffer_t buffer, uint32_t offset, void *data, uint32_t data_len) {
+  memcpy(data, (uint8_t *)framebuffers[buffer] + offset, data_len);
+}
+
+void buffer_write(buffer_t buffer, uint32_t offset, void *data, uint32_t data_len) {
+  if (offset + data_len > stub_display_width * stub_display_height * sizeof(uint32_t)) {
+    fprintf(stderr, "stub: buffer_write out of bounds (offset %u, length %u)\n", offset, data_len);
+    exit(1);
+  }
+  memcpy((uint8_t *)framebuffers[buffer] + offset, data, data_len);
+  if (!stub_counters.buffer_writes || sim_nanos != last_write_nanos) {
+    stub_counters.frames++;
+    last_write_nanos = sim_nanos;
+  }
+  stub_counters.buffer_writes++;
+  stub_counters.buffer_bytes += data_len;
+}
+
+uint32_t attr_init(const char *name, uint32_t default_value) {
+  stub_attr_t *attr = &attr_values[attr_value_count];
+  *attr = (stub_attr_t){.name = name, .value = default_value};
+  for (uint32_t i = 0; i < attr_count; i++) {
+    if (!strcmp(attrs[i].name, name)) {
+      attr->value = attrs[i].value;
+    }
+  }
+  return attr_value_count++;
+}
+
+uint32_t attr_read(uint32_t attr_id) {
+  return attr_values[attr_id].value;
+}
+
+string_t attr_string_init(const char *name) {
+  for (uint32_t i = 0; i < attr_count; i++) {
+    if (!strcmp(attrs[i].name, name) && attrs[i].string) {
+      attr_values[attr_value_count] = attrs[i];
+      return ++attr_value_count; // 0 is STRING_NULL
+    }
+  }
+  return STRING_NULL;
+}
+
+uint32_t string_get_length(string_t string) {
+  return string ? strlen(attr_values[string - 1].string) : 0;
+}
+
+uint32_t string_read(string_t string, char *buf, uint32_t buffer_size) {
+  const char *value = string ? attr_values[string - 1].string : "";
+  if (!buffer_size) {
+    return 0;
+  }
+  strncpy(buf, value, buffer_size - 1);
+  buf[buffer_size - 1] = 0;
+  return strlen(buf);
+}
+
+void *_symbol_resolve(char *symbol_name) {
+  for (uint32_t i = 0; i < symbol_count; i++) {
+    if (!strcmp(symbols[i].name, symbol_name)) {
+      return (void *)(uintptr_t)symbols[i].address;
+    }
+  }
+  return NULL;
+}
+
+// Like the simulator, the chip sees MCU addresses, not host pointers: reads outside the
+// MCU memory fail
+bool _mcu_read_memory(const void *address, void *target, uint32_t size) {
+  const uintptr_t start = (uintptr_t)address;
+  if (start > STUB_MCU_MEMORY_SIZE || size > STUB_MCU_MEMORY_SIZE - start) {
+    return false;
+  }
+  memcpy(target, &mcu_memory[start], size);
+  return true;
+}
+
+uint32_t _mcu_read_uint32(const void *address) {
+  uint8_t bytes[4] = {0};
+  _mcu_read_memory(address, bytes, sizeof(bytes));
+  return bytes[0] | bytes[1] << 8 | bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+void *_mcu_read_ptr(const void *address) {
+  return (void *)(uintptr_t)_mcu_read_uint32(address);
+}
@@ -0,0 +1,65 @@
+// Native stand-in for the Wokwi simulator, used by the benchmark harness.
+//
+// SPDX-License-Identifier: MIT
+// Copyright (C) 2024 Uri Shaked / wokwi.com
+
+#ifndef WOKWI_STUB_H
+#define WOKWI_STUB_H
+
+#include "wokwi-api.h"
+
+#define STUB_MAX_DEVICES 8
+#define STUB_MCU_MEMORY_SIZE 0x10000 // 64 KB, addressable with the 16-bit pointers of AVR
+
+typedef struct {
+  uint32_t frames; // simulated timestamps at which the framebuffer was written
+  uint32_t buffer_writes;
+  uint64_t buffer_bytes;
+} stub_counters_t;
+
+extern stub_counters_t stub_counters;
+
+// Display size reported by framebuffer_init(), as chip.json would define it
+extern uint32_t stub_display_width;
+extern uint32_t stub_display_height;
+
+// Attributes returned by attr_init() / attr_string_init() for the next chip_init() calls
+void stub_set_attr(const char *name, uint32_t value);
+void stub_set_attr_string(const char *name, const char *value);
+void stub_clear_attrs(void);
+
+// Firmware symbol returned by _symbol_resolve(), at an address of the MCU memory. The
+// MCU is little-endian and its memory is cleared by stub_reset().
+void stub_set_symbol(const char *name, uint32_t address);
+
+// Host pointer to the MCU memory at `address`, to write the firmware's variables
+uint8_t *stub_mcu_memory(uint32_t address);
+
+// Forgets all the devices, timers, framebuffers and symbols
+void stub_reset(void);
+
+uint32_t stub_device_count(void);
+
+// The user_data pointer that the n-th device passed to i2c_init(), i.e. its chip instance
+void *stub_i2c_user_data(uint32_t device);
+
+// I2C bus helpers, talking to the device registered by the n-th i2c_init() call
+void stub_i2c_start(uint32_t device, bool read);
+void stub_i2c_write(uint32_t device, uint8_t value);
+uint8_t stub_i2c_read(uint32_t device);
+void stub_i2c_stop(uint32_t device);
+void stub_i2c_transfer(uint32_t device, const uint8_t *data, uint32_t count);
+
+// Advances the simulated clock, firing the timers that expire on the way
+void stub_advance(uint64_t nanos);
+uint64_t stub_now(void);
+
+// Sends the console output (stdout) of the chips to a new temporary file, until
+// stub_console_end(). Returns the file name, the caller removes the file.
+const char *stub_console_begin(void);
+void stub_console_end(void);
+
+// RGBA contents of the n-th framebuffer
+const uint32_t *stub_framebuffer(uint32_t index);
+
+#endif /* WOKWI_STUB_H */
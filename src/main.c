@@ -7,14 +7,18 @@
 // Datasheet: https://www.displayfuture.com/Display/datasheet/controller/SH1107.pdf
 
 #include "wokwi-api.h"
+#include "sh1107-trace.h"
+#include "sh1107-capture.h"
 #include <stdio.h>
-#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
 #define SH1107_CONTROL_CO 0x80
 #define SH1107_CONTROL_DC 0x40
 
+// Status byte, read with D/C=0. The BUSY flag (bit 7) is never set.
+#define SH1107_STATUS_DISPLAY_OFF 0x40
+
 #define CMD_SET_PAGE_ADDR_MODE 0x20
 #define CMD_SET_VERTICAL_ADDR_MODE 0x21
 #define CMD_SET_CONTRAST 0x81
@@ -40,288 +44,1655 @@
 #define CMD_END 0xee
 #define CMD_NOP 0xe3
 
-// Specifies the number of parameter bytes for each multi-byte command
-const uint8_t multi_byte_commands[] = {
-    [CMD_SET_CONTRAST] = 1,
-    [CMD_SET_MULTIPLEX] = 1,
-    [CMD_DCDC] = 1,
-    [CMD_SET_DISPLAY_OFFSET] = 1,
-    [CMD_SET_COM_PINS] = 1,
-    [CMD_SET_DISPLAY_CLOCK_DIV] = 1,
-    [CMD_SET_PRECHARGE] = 1,
-    [CMD_SET_VCOM_DESELECT] = 1,
-    [CMD_SET_DISP_START_LINE] = 1,
+#define DEFAULT_I2C_ADDRESS 0x3c // 0x3d with the SA0 pin high
+#define DEFAULT_REFRESH_INTERVAL 16667 // microseconds, ~60 Hz
+#define ADAPTIVE_REFRESH_MAX_FACTOR 4   // adaptive refresh slows down to at most 1/4 of the rate
+#define OSCILLATOR_FREQUENCY 370000 // Hz, internal oscillator at the POR frequency setting
+#define ROW_OVERHEAD_CLOCKS 50      // display clocks per row on top of the precharge phases
+#define UNKNOWN_COMMAND_REPORT_EVERY 1024 // after the first report, unknown opcodes are only counted
+#define TRACE_BUFFER_SIZE 1024
+#define TRACE_FLUSH_INTERVAL 100000 // microseconds: print the recorded I2C traffic at least every 100 ms
+#define TRACE_LINE_BYTES 64
+#define MCU_SYMBOL_LENGTH 64
+#define COMMAND_QUEUE_SIZE 64 // command bytes decoded together, see sh1107_burst_command()
+#define CAPTURE_FLUSH_INTERVAL 1000000 // microseconds: print captured frames at least every second
+#define COLOR_NAME_LENGTH 16
+#define DEFAULT_COLOR 0xffffff // panel tint (color attribute), 0xRRGGBB
+#define CONTRAST_MIN_LEVEL 0x40 // brightness at contrast 0, out of 255: the lowest setting stays visible
+
+// Number of SH1107 displays a project may use, see chip_init(): one per I2C address (SA0
+// pin low or high). Each one takes about 70 KB, mostly the frame cache.
+#ifndef SH1107_MAX_INSTANCES
+#define SH1107_MAX_INSTANCES 2
+#endif
+// The buffers of the opt-in features come from their own pools, and are only handed out
+// to the displays that enable the feature
+#ifndef SH1107_MAX_CAPTURES
+#define SH1107_MAX_CAPTURES 1 // displays with captureFrames, 17 KB each
+#endif
+#ifndef SH1107_MAX_TRACES
+#define SH1107_MAX_TRACES SH1107_MAX_INSTANCES // displays with traceI2C, 1 KB each
+#endif
+#ifndef SH1107_MAX_MCU_BUFFERS
+#define SH1107_MAX_MCU_BUFFERS SH1107_MAX_INSTANCES // displays with mcuBuffer, 2 KB each
+#endif
+#define SH1107_CACHE_LINE 64
+
+// Frames kept by the capture ring buffer, see sh1107_capture_frame()
+#ifndef SH1107_CAPTURE_FRAMES
+#define SH1107_CAPTURE_FRAMES 8
+#endif
+_Static_assert(SH1107_CAPTURE_FRAMES >= 2, "the capture ring keeps the previous frame as the XOR base");
+
+// GDDRAM geometry, whatever the size of the panel: 128 columns by 16 pages of 8 rows
+#define GDDRAM_COLUMNS 128
+#define GDDRAM_ROWS 128
+#define GDDRAM_PAGES (GDDRAM_ROWS / 8)
+#define GDDRAM_COLUMN_MASK (GDDRAM_COLUMNS - 1)
+#define GDDRAM_ROW_MASK (GDDRAM_ROWS - 1)
+
+#define RENDER_KEY_NONE 0xffffffff
+#define RENDER_KEY_DISPLAY_OFF 0xfffffffe
+#define RENDER_KEY_ALL_ON 0xfffffffd
+
+// Command descriptor flags, see sh1107_commands[]
+#define COMMAND_AFFECTS_RENDER 0x01  // may change the displayed image: schedule an update
+#define COMMAND_AFFECTS_ADDRESS 0x02 // moves the GDDRAM address counters
+
+// Expands a GDDRAM byte (8 vertical pixels, LSB on top) into 8 pixel masks, all ones for
+// the pixels that are set. The renderer turns them into palette colors, see sh1107_update_palette().
+#define PIXEL_WORD(value, bit) ((((value) >> (bit)) & 1) ? 0xffffffff : 0)
+#define PIXEL_LUT_1(value)                                                                       \
+  {PIXEL_WORD(value, 0), PIXEL_WORD(value, 1), PIXEL_WORD(value, 2), PIXEL_WORD(value, 3),       \
+   PIXEL_WORD(value, 4), PIXEL_WORD(value, 5), PIXEL_WORD(value, 6), PIXEL_WORD(value, 7)}
+#define PIXEL_LUT_4(value)                                                                       \
+  PIXEL_LUT_1(value), PIXEL_LUT_1(value + 1), PIXEL_LUT_1(value + 2), PIXEL_LUT_1(value + 3)
+#define PIXEL_LUT_16(value)                                                                      \
+  PIXEL_LUT_4(value), PIXEL_LUT_4(value + 4), PIXEL_LUT_4(value + 8), PIXEL_LUT_4(value + 12)
+#define PIXEL_LUT_64(value)                                                                      \
+  PIXEL_LUT_16(value), PIXEL_LUT_16(value + 16), PIXEL_LUT_16(value + 32), PIXEL_LUT_16(value + 48)
+
+static const uint32_t pixel_lut[256][8] = {PIXEL_LUT_64(0), PIXEL_LUT_64(64), PIXEL_LUT_64(128), PIXEL_LUT_64(192)};
+
+// The SIMD renderer is used when building with -msimd128 (see `make dist/chip-simd.wasm`)
+#if !defined(SH1107_SIMD) && defined(__wasm_simd128__)
+#define SH1107_SIMD 1
+#endif
+
+#if SH1107_SIMD
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+
+// Bit masks for the left and right halves of an output run, for segment remap off and on
+static const u32x4 simd_bit_masks[2][2] = {
+    {{0x01, 0x02, 0x04, 0x08}, {0x10, 0x20, 0x40, 0x80}},
+    {{0x80, 0x40, 0x20, 0x10}, {0x08, 0x04, 0x02, 0x01}},
 };
 
+// Converts an 8x8 block of page-organized GDDRAM (8 columns of 8 vertical pixels)
+// into 8 row-major runs of 8 pixels: a bit-matrix transpose, then a mask expansion
+// of each row byte into 32-bit words, selecting the `off` or `off ^ flip` palette color.
+static void sh1107_expand_block_simd(uint32_t *const rows[8], uint32_t x, const uint8_t *source,
+                                     const u32x4 bit_masks[2], uint32_t off, uint32_t flip)
+{
+  uint64_t block;
+  memcpy(&block, source, sizeof(block));
+
+  // Byte n holds column n; after the transpose, byte n holds row n
+  uint64_t t;
+  t = (block ^ (block >> 7)) & 0x00aa00aa00aa00aaULL;
+  block ^= t ^ (t << 7);
+  t = (block ^ (block >> 14)) & 0x0000cccc0000ccccULL;
+  block ^= t ^ (t << 14);
+  t = (block ^ (block >> 28)) & 0x00000000f0f0f0f0ULL;
+  block ^= t ^ (t << 28);
+
+  const u32x4 low_bits = bit_masks[0];
+  const u32x4 high_bits = bit_masks[1];
+  for (uint8_t row = 0; row < 8; row++) {
+    const u32x4 value = (u32x4){0} + (uint32_t)((block >> (row * 8)) & 0xff);
+    const u32x4 low = (((u32x4)((value & low_bits) != 0)) & flip) ^ off;
+    const u32x4 high = (((u32x4)((value & high_bits) != 0)) & flip) ^ off;
+    memcpy(&rows[row][x], &low, sizeof(low));
+    memcpy(&rows[row][x + 4], &high, sizeof(high));
+  }
+}
+#endif
+
+// Performance counters, reported by sh1107_print_stats()
 typedef struct
 {
-  // Display buffer
-  uint32_t width;
-  uint32_t height;
-  int8_t x_offset;
-  uint8_t pixels[128 * 128 / 8];
-  buffer_t framebuffer;
-  timer_t update_timer;
+  uint32_t i2c_transactions;
+  uint32_t i2c_bytes;
+  uint32_t command_bytes;
+  uint32_t data_bytes;
+  uint32_t frames_scheduled;
+  uint32_t frames_rendered;
+  uint32_t frames_skipped; // update timer fired, but nothing visible had changed
+  uint32_t buffer_writes;
+  uint64_t pixels_written;
+  uint64_t pixels_rendered; // frame pixels computed: expanded from GDDRAM bits, recolored or filled
+  uint32_t commands[256]; // histogram of the command opcodes
+} sh1107_stats_t;
+
+// A rendered frame, as stored by sh1107_capture_frame()
+typedef struct
+{
+  uint64_t nanos;
+  uint8_t settings[CAPTURE_SETTINGS_SIZE];
+  uint32_t page_version[GDDRAM_PAGES]; // see sh1107_state_t::page_version
+  uint8_t pixels[GDDRAM_PAGES * GDDRAM_COLUMNS];
+} sh1107_capture_t;
+
+// Instance state, allocated from sh1107_instances[]. The fields used by every I2C byte
+// come first, packed in the first cache line; the large buffers come last.
+typedef struct __attribute__((aligned(SH1107_CACHE_LINE)))
+{
+  // I2C data burst (Co=0, D/C=1): GDDRAM writes go straight to burst_target,
+  // the dirty region is worked out when the burst ends, see sh1107_end_burst().
+  // Command bursts (Co=0, D/C=0) are queued in command_queue instead.
+  void (*burst_write)(void *state, uint8_t value);
+  uint8_t *burst_target;
+  uint32_t burst_count;
+  uint8_t burst_changed;
+  uint16_t burst_pages; // pages an open data burst can write to, see sh1107_capture_frame()
+
+  // Command parsing state machine
+  bool control_byte;
+  bool continuous_mode;
+  bool command_mode;
+  uint8_t current_command_index;
+  uint8_t current_command_length;
+  uint8_t current_command[8];
+
+  // Memory and addressing settings
+  uint8_t active_column;
+  uint8_t active_page;
+  uint8_t memory_mode;
+  // Read-modify-write (CMD_READ_MODIFY_WRITE to CMD_END): reads leave the column address
+  // alone, and CMD_END moves it back to rmw_column
+  bool read_modify_write;
+  uint8_t rmw_column;
+  uint8_t read_latch; // GDDRAM byte loaded by the previous data read, see sh1107_i2c_read()
+
+  bool updated;
+  bool trace_enabled;
+  uint8_t address; // I2C address, printed with the trace and capture lines
+  const uint8_t *mcu_buffer; // see sh1107_mcu_init(), NULL when the data comes from I2C
+
+  uint8_t command_queue[COMMAND_QUEUE_SIZE] __attribute__((aligned(SH1107_CACHE_LINE)));
+
+  // Statistics report, every `stats_frames` frames and/or every `stats_interval` milliseconds.
+  // The byte counters at the start of `stats` are also updated for every I2C byte.
+  sh1107_stats_t stats __attribute__((aligned(SH1107_CACHE_LINE)));
+  uint32_t stats_frames;
+  uint32_t stats_interval;
+  timer_t stats_timer;
 
   // Display settings
   bool display_on;
-  bool updated;
+  bool all_on;
   uint8_t contrast;
   bool invert;
+  uint32_t color; // panel tint, 0xRRGGBB (color attribute)
+  // Colors of the GDDRAM bit values 0 and 1, for the current contrast, invert and tint
+  uint32_t palette[2];
   bool reverse_rows;
   bool segment_remap;
-  
+  uint8_t start_line;
+  uint8_t display_offset;
+
   // Speed and timing settings
   uint8_t clock_divider;
-  uint8_t multiplex_ratio;
+  uint8_t oscillator_frequency; // -25% (0) to +50% (15) of OSCILLATOR_FREQUENCY, in 5% steps
+  uint8_t multiplex_ratio; // number of driven COM lines - 1
   uint8_t phase1;
   uint8_t phase2;
 
-  // Memory and addressing settings
-  uint8_t active_column;
-  uint8_t active_page;
-  uint8_t memory_mode;
+  // Refresh timing, see sh1107_schedule_update()
+  uint32_t refresh_interval; // microseconds, 0 = at the end of each I2C transaction
+  bool panel_timing; // refresh_interval follows the panel frame rate, see sh1107_update_panel_timing()
+  bool adaptive_refresh;
+  bool low_latency; // present the first change after an idle period when its I2C transaction ends
+  bool present_on_stop;
+  uint32_t frame_interval; // current interval, microseconds
+  uint64_t last_frame_nanos;
+  timer_t update_timer;
 
-  uint8_t start_line;
+  // Panel geometry. The size comes from the "display" entry of chip.json, through
+  // framebuffer_init(), and may be smaller than the GDDRAM. Larger panels show the GDDRAM
+  // in their top left corner: `stride` is then the length of the host framebuffer rows.
+  uint32_t width;
+  uint32_t height;
+  uint32_t stride;
+  uint8_t x_offset;
+  buffer_t framebuffer;
 
-  // Command parsing state machine
-  bool control_byte;
-  bool continuous_mode;
-  bool command_mode;
-  uint8_t current_command_index;
-  uint8_t current_command_length;
-  uint8_t current_command[8];
+  // Settings the last frame was rendered with, see sh1107_render_key()
+  uint32_t rendered_key;
+  uint8_t rendered_scroll;
+  uint32_t rendered_palette[2];
+
+  // Dirty region tracking: GDDRAM column range written in each page since the last update
+  uint16_t dirty_pages;
+  uint8_t dirty_column_min[GDDRAM_PAGES];
+  uint8_t dirty_column_max[GDDRAM_PAGES];
+  // Change counter of each page, for the consumers that keep their own copy of the GDDRAM
+  // (frame capture): bumped for every change in the page, and for all pages when the render
+  // settings change. The renderer itself uses the dirty region above.
+  uint32_t page_version[GDDRAM_PAGES];
+  // Pages with rows that were off the panel when rendered, redrawn when the start line changes
+  uint16_t hidden_pages;
+  // Frame row of each GDDRAM row, and output column of each GDDRAM column.
+  // Rebuilt by sh1107_update_mapping() when the render key changes.
+  uint8_t row_map[GDDRAM_ROWS];
+  uint8_t column_map[GDDRAM_COLUMNS];
+  // GDDRAM column ranges shown on the panel, each one landing on a contiguous output span
+  uint8_t column_span_first[2];
+  uint8_t column_span_last[2];
+  uint8_t column_span_count;
+
+  // MCU memory sniffing (mcuBuffer attribute): the GDDRAM content is read from the firmware's
+  // display buffer on each refresh tick, and the I2C data bytes are ignored
+  bool mcu_buffer_indirect; // mcu_buffer is the address of a pointer to the buffer
+  uint32_t mcu_pointer_size; // bytes per firmware pointer, 2 on AVR
+  uint32_t mcu_buffer_columns; // bytes per page in the firmware buffer
+  uint32_t mcu_buffer_pages;
+  timer_t mcu_timer;
+
+  // I2C trace recording, see sh1107_trace_event()
+  uint32_t trace_length;
+  uint32_t trace_write_record; // offset of the length byte of the open TRACE_WRITE record, 0 if none
+  uint64_t trace_nanos;        // time of the last record
+  uint32_t trace_records;      // records since the last sh1107_trace_flush()
+  timer_t trace_timer;
+
+  // Frame capture (captureFrames attribute): frame n is in captures[n % SH1107_CAPTURE_FRAMES]
+  bool capture_enabled;
+  uint32_t capture_count;    // frames captured
+  uint32_t capture_exported; // frames printed, see sh1107_capture_flush()
+  timer_t capture_timer;
+
+#if SH1107_REFERENCE_CHECK
+  // Compare every rendered frame against sh1107_render_reference() (referenceCheck attribute)
+  bool reference_check;
+#endif
+
+  // Display RAM, 8 vertical pixels per byte
+  uint8_t pixels[GDDRAM_PAGES * GDDRAM_COLUMNS] __attribute__((aligned(SH1107_CACHE_LINE)));
+  // Rendered RGBA rows of `width` pixels, in COM scan order. The display start line only
+  // rotates them when they are sent to the host, so scrolling does not re-render anything.
+  uint32_t frame[GDDRAM_ROWS * GDDRAM_COLUMNS];
+  uint32_t hidden_row[GDDRAM_COLUMNS]; // render target of the rows that are off the panel
+
+  // Buffers of the opt-in features, see sh1107_pool_take()
+  uint8_t *mcu_snapshot; // GDDRAM_PAGES * GDDRAM_COLUMNS bytes
+  uint8_t *trace;        // TRACE_BUFFER_SIZE bytes
+  sh1107_capture_t *captures; // SH1107_CAPTURE_FRAMES frames
+#if SH1107_REFERENCE_CHECK
+  uint32_t *sent_image; // copy of the host framebuffer, see sh1107_send_pixels()
+#endif
 } sh1107_state_t;
 
+// Everything a display needs is in its instance; the lookup tables (pixel_lut,
+// sh1107_commands, ...) are read-only and shared by all of them.
+static sh1107_state_t sh1107_instances[SH1107_MAX_INSTANCES];
+static uint32_t sh1107_instance_count;
+
+static uint8_t sh1107_mcu_snapshots[SH1107_MAX_MCU_BUFFERS][GDDRAM_PAGES * GDDRAM_COLUMNS];
+static uint32_t sh1107_mcu_snapshot_count;
+static uint8_t sh1107_traces[SH1107_MAX_TRACES][TRACE_BUFFER_SIZE];
+static uint32_t sh1107_trace_count;
+static sh1107_capture_t sh1107_captures[SH1107_MAX_CAPTURES][SH1107_CAPTURE_FRAMES];
+static uint32_t sh1107_capture_count;
+#if SH1107_REFERENCE_CHECK
+static uint32_t sh1107_sent_images[SH1107_MAX_INSTANCES][GDDRAM_ROWS * GDDRAM_COLUMNS];
+static uint32_t sh1107_sent_image_count;
+#endif
+
+// Hands out the next buffer of a pool of `capacity` buffers of `size` bytes, or returns
+// NULL (and the feature stays off) when they are all in use
+static void *sh1107_pool_take(void *pool, uint32_t *count, uint32_t capacity, uint32_t size, const char *feature)
+{
+  if (*count == capacity) {
+    printf("SH1107: %s is only available on %u displays, see SH1107_MAX_* in main.c\n", feature, capacity);
+    return NULL;
+  }
+  return (uint8_t *)pool + (*count)++ * size;
+}
+
+// Power-on state of the controller
 static void sh1107_reset(sh1107_state_t *state)
 {
-  state->width = 128;
-  state->height = 128;
-  state->x_offset = 96; // varias between display models
+  memset(state, 0, sizeof(*state));
+  state->x_offset = 96; // varies between display models, see the xOffset attribute
   state->memory_mode = CMD_SET_PAGE_ADDR_MODE;
   state->contrast = 0x7f;
+  state->color = DEFAULT_COLOR;
   state->clock_divider = 1;
-  state->multiplex_ratio = 63;
+  state->oscillator_frequency = 5;
+  state->multiplex_ratio = 127;
   state->phase1 = 2;
   state->phase2 = 2;
-  state->current_command_index = 0;
-  state->active_column = 0;
-  state->active_page = 0;
-  state->start_line = 0;
-  state->reverse_rows = false;  
-  state->invert = false;
-  state->updated = false;
+  state->control_byte = true;
+  state->command_mode = true;
+  state->rendered_key = RENDER_KEY_NONE;
 }
 
-void sh1107_update_buffer(void *user_data) {
-  sh1107_state_t *state = user_data;
+static void sh1107_mark_dirty(sh1107_state_t *state, uint8_t page, uint8_t column)
+{
+  const uint16_t page_mask = 1 << page;
+  state->page_version[page]++;
+  if (!(state->dirty_pages & page_mask)) {
+    state->dirty_pages |= page_mask;
+    state->dirty_column_min[page] = column;
+    state->dirty_column_max[page] = column;
+  } else if (column < state->dirty_column_min[page]) {
+    state->dirty_column_min[page] = column;
+  } else if (column > state->dirty_column_max[page]) {
+    state->dirty_column_max[page] = column;
+  }
+}
+
+static void sh1107_mark_dirty_columns(sh1107_state_t *state, uint8_t page, uint8_t column_min, uint8_t column_max)
+{
+  sh1107_mark_dirty(state, page, column_min);
+  sh1107_mark_dirty(state, page, column_max);
+}
+
+// Packs every setting that changes how the whole GDDRAM is rendered. A frame rendered
+// with a different key must be redrawn in full. The start line is not part of it, as
+// it only rotates the rendered rows.
+static uint32_t sh1107_render_key(const sh1107_state_t *state)
+{
+  if (!state->display_on) {
+    return RENDER_KEY_DISPLAY_OFF;
+  }
+  if (state->all_on) {
+    return RENDER_KEY_ALL_ON;
+  }
+  return state->reverse_rows | state->segment_remap << 1 | state->x_offset << 8 | state->multiplex_ratio << 16;
+}
+
+// Color of a lit pixel: the panel tint, dimmed by the contrast setting (the OLED segment
+// current). RGBA, as stored in the host framebuffer.
+static uint32_t sh1107_lit_color(const sh1107_state_t *state)
+{
+  const uint32_t level = CONTRAST_MIN_LEVEL + state->contrast * (255 - CONTRAST_MIN_LEVEL) / 255;
+  const uint32_t red = ((state->color >> 16) & 0xff) * level / 255;
+  const uint32_t green = ((state->color >> 8) & 0xff) * level / 255;
+  const uint32_t blue = (state->color & 0xff) * level / 255;
+  return 0xff000000 | blue << 16 | green << 8 | red;
+}
+
+// Invert, contrast and tint only change the colors of the rendered pixels, not which ones
+// are lit: they are applied through the palette, not the render key. Unlit pixels are
+// transparent black, so the two colors always differ, see sh1107_recolor_frame().
+static void sh1107_update_palette(sh1107_state_t *state)
+{
+  const uint32_t lit = sh1107_lit_color(state);
+  state->palette[0] = state->invert ? lit : 0;
+  state->palette[1] = state->invert ? 0 : lit;
+}
+
+static bool sh1107_palette_changed(const sh1107_state_t *state)
+{
+  return state->palette[0] != state->rendered_palette[0] || state->palette[1] != state->rendered_palette[1];
+}
+
+// Number of panel rows the controller drives: the first multiplex_ratio + 1 COM lines.
+// The other rows stay dark.
+static uint32_t sh1107_active_rows(const sh1107_state_t *state)
+{
+  const uint32_t rows = state->multiplex_ratio + 1;
+  return rows < state->height ? rows : state->height;
+}
+
+// Frame row shown on the top panel row. The display offset and the start line both
+// rotate the rendered rows, see sh1107_send_rows().
+static uint32_t sh1107_scroll(const sh1107_state_t *state)
+{
+  return (state->display_offset + state->start_line) & GDDRAM_ROW_MASK;
+}
+
+// True when the panel shows the GDDRAM content (not blanked by CMD_DISPLAY_OFF or CMD_DISPLAY_ALL_ON)
+static bool sh1107_shows_gddram(const sh1107_state_t *state)
+{
+  return state->display_on && !state->all_on;
+}
+
+// Applies the COM scan direction, segment remap and column offset, which the controller
+// does when reading GDDRAM out to the panel. The start line is applied in sh1107_send_rows().
+static void sh1107_update_mapping(sh1107_state_t *state)
+{
+  const uint32_t width = state->width;
+  for (uint32_t row = 0; row < GDDRAM_ROWS; row++) {
+    state->row_map[row] = state->reverse_rows ? (state->multiplex_ratio - row) & GDDRAM_ROW_MASK : row;
+  }
+
+  // Columns that map past the panel width are not shown. The shown ones are split into
+  // spans that neither wrap around the GDDRAM nor the panel: at most two of them.
+  state->column_span_count = 0;
+  uint32_t previous_x = 0;
+  for (uint32_t column = 0; column < GDDRAM_COLUMNS; column++) {
+    const uint32_t segment = state->segment_remap ? GDDRAM_COLUMN_MASK - column : column;
+    const uint32_t x = (segment - state->x_offset) & GDDRAM_COLUMN_MASK;
+    state->column_map[column] = x;
+    if (x >= width) {
+      continue;
+    }
+    const uint8_t span = state->column_span_count;
+    if (span && state->column_span_last[span - 1] == column - 1 && (x == previous_x + 1 || x + 1 == previous_x)) {
+      state->column_span_last[span - 1] = column;
+    } else {
+      state->column_span_first[span] = column;
+      state->column_span_last[span] = column;
+      state->column_span_count++;
+    }
+    previous_x = x;
+  }
+}
+
+// Writes `count` pixels from panel row y, column x. They may only run past the end of the
+// row when the panel is as wide as the host framebuffer.
+static void sh1107_send_pixels(sh1107_state_t *state, uint32_t y, uint32_t x, const uint32_t *data, uint32_t count)
+{
+  buffer_write(state->framebuffer, (y * state->stride + x) * sizeof(uint32_t), (void *)data, count * sizeof(uint32_t));
+  state->stats.buffer_writes++;
+  state->stats.pixels_written += count;
+#if SH1107_REFERENCE_CHECK
+  if (state->sent_image) {
+    memcpy(&state->sent_image[y * state->width + x], data, count * sizeof(uint32_t));
+  }
+#endif
+}
+
+// Sends the touched frame rows to the active panel rows. Frame row sh1107_scroll() is the
+// top of the display. Consecutive full rows are merged into a single transfer when they
+// are contiguous in the host framebuffer, so a full frame usually takes at most two.
+static void sh1107_send_rows(sh1107_state_t *state, const bool *row_dirty, const uint8_t *row_x0,
+                             const uint8_t *row_x1)
+{
+  const uint32_t width = state->width;
+  const uint32_t height = sh1107_active_rows(state);
+  const uint32_t scroll = sh1107_scroll(state);
+  const uint32_t *frame = state->frame;
+  const bool merge_rows = width == state->stride;
+
+  for (uint32_t y = 0; y < height;) {
+    const uint32_t row = (y + scroll) & GDDRAM_ROW_MASK;
+    if (!row_dirty[row]) {
+      y++;
+      continue;
+    }
+    if (row_x0[row] == 0 && row_x1[row] == width - 1) {
+      uint32_t end = y + 1;
+      uint32_t next = row + 1;
+      while (merge_rows && end < height && next < GDDRAM_ROWS && row_dirty[next] && row_x0[next] == 0 && row_x1[next] == width - 1) {
+        end++;
+        next++;
+      }
+      sh1107_send_pixels(state, y, 0, &frame[row * width], (end - y) * width);
+      y = end;
+    } else {
+      sh1107_send_pixels(state, y, row_x0[row], &frame[row * width + row_x0[row]],
+                         row_x1[row] - row_x0[row] + 1);
+      y++;
+    }
+  }
+}
+
+// Clears the panel rows past the multiplex ratio. Only needed after a full redraw,
+// they are skipped by all the other frames.
+static void sh1107_blank_inactive_rows(sh1107_state_t *state)
+{
+  const uint32_t width = state->width;
+  memset(state->hidden_row, 0, sizeof(state->hidden_row));
+  for (uint32_t y = sh1107_active_rows(state); y < state->height; y++) {
+    sh1107_send_pixels(state, y, 0, state->hidden_row, width);
+  }
+}
+
+// Expands the columns column_min..column_max of one GDDRAM page into the 8 frame rows
+// it covers, `rows`, in the palette colors. The columns must be within one span of
+// sh1107_update_mapping(). Instantiated by SH1107_RENDER_KERNELS for both segment remap
+// settings, so that the output direction is a compile-time constant in the inner loop.
+// The COM scan direction only selects the row pointers, through row_map, and the invert
+// setting only the palette.
+static inline __attribute__((always_inline)) void sh1107_render_page(sh1107_state_t *state, uint32_t *const rows[8],
+                                                                     uint32_t page, uint32_t column_min,
+                                                                     uint32_t column_max, const bool segment_remap)
+{
+  const uint8_t *column_map = state->column_map;
+  const uint8_t *source = &state->pixels[page * GDDRAM_COLUMNS];
+  // Pixel color = off ^ (mask & flip): off for the clear bits, on for the set ones
+  const uint32_t off = state->palette[0];
+  const uint32_t flip = state->palette[0] ^ state->palette[1];
+
+  uint32_t column = column_min;
+#if SH1107_SIMD
+  // Aligned 8-column blocks stay contiguous in the output, and within a span, when the
+  // x offset and the panel width are multiples of 8
+  if (state->x_offset % 8 == 0 && state->width % 8 == 0) {
+    for (column &= ~7; column <= column_max; column += 8) {
+      const uint32_t x = column_map[segment_remap ? column + 7 : column];
+      sh1107_expand_block_simd(rows, x, &source[column], simd_bit_masks[segment_remap], off, flip);
+    }
+  }
+#endif
+  if (column > column_max) {
+    return;
+  }
+  // Within a span, the output column moves by one per GDDRAM column: to the right, or to
+  // the left with the segment remap. The constant direction replaces the column_map lookup.
+  const uint32_t stride = segment_remap ? -1 : 1;
+  for (uint32_t x = column_map[column]; column <= column_max; column++, x += stride) {
+    const uint32_t *words = pixel_lut[source[column]];
+    rows[0][x] = (words[0] & flip) ^ off;
+    rows[1][x] = (words[1] & flip) ^ off;
+    rows[2][x] = (words[2] & flip) ^ off;
+    rows[3][x] = (words[3] & flip) ^ off;
+    rows[4][x] = (words[4] & flip) ^ off;
+    rows[5][x] = (words[5] & flip) ^ off;
+    rows[6][x] = (words[6] & flip) ^ off;
+    rows[7][x] = (words[7] & flip) ^ off;
+  }
+}
+
+typedef void (*sh1107_render_kernel_t)(sh1107_state_t *state, uint32_t *const rows[8], uint32_t page,
+                                       uint32_t column_min, uint32_t column_max);
+
+// X(segment_remap)
+#define SH1107_RENDER_KERNELS(X) X(0) X(1)
+
+#define SH1107_RENDER_KERNEL(segment_remap)                                                      \
+  static void sh1107_render_page_##segment_remap(sh1107_state_t *state, uint32_t *const rows[8], \
+                                                  uint32_t page, uint32_t column_min,             \
+                                                  uint32_t column_max)                            \
+  {                                                                                              \
+    sh1107_render_page(state, rows, page, column_min, column_max, segment_remap);              \
+  }
+SH1107_RENDER_KERNELS(SH1107_RENDER_KERNEL)
+#undef SH1107_RENDER_KERNEL
+
+#define SH1107_RENDER_KERNEL(segment_remap) [segment_remap] = sh1107_render_page_##segment_remap,
+static const sh1107_render_kernel_t sh1107_render_kernels[2] = {SH1107_RENDER_KERNELS(SH1107_RENDER_KERNEL)};
+#undef SH1107_RENDER_KERNEL
+
+// Palette change only (contrast, invert or tint): the rendered pixels keep their bit
+// values, so the frame is recolored in place instead of decoding the GDDRAM again.
+// Rows that were off the panel may hold stale colors; their pages are redrawn when
+// they are scrolled in (hidden_pages).
+static void sh1107_recolor_frame(sh1107_state_t *state)
+{
+  const uint32_t old_on = state->rendered_palette[1];
+  const uint32_t off = state->palette[0];
+  const uint32_t on = state->palette[1];
+  const uint32_t count = GDDRAM_ROWS * state->width;
+  uint32_t *frame = state->frame;
+  for (uint32_t i = 0; i < count; i++) {
+    frame[i] = frame[i] == old_on ? on : off;
+  }
+  state->stats.pixels_rendered += count;
+}
+
+// Returns false when nothing had to be sent to the host
+static bool sh1107_render_frame(sh1107_state_t *state)
+{
+  const uint8_t *row_map = state->row_map;
+  const uint8_t *column_map = state->column_map;
+  const uint32_t width = state->width;
+  const uint32_t height = state->height;
+  uint32_t *frame = state->frame;
+
+  const uint32_t render_key = sh1107_render_key(state);
+  sh1107_update_palette(state);
+  const bool palette_changed = sh1107_palette_changed(state);
+  if (!sh1107_shows_gddram(state)) {
+    // Constant frame: sent once when entering the state, GDDRAM writes are kept for later.
+    // CMD_DISPLAY_ALL_ON lights the active rows only, in the lit color whatever the invert setting.
+    if (render_key != state->rendered_key || (state->display_on && palette_changed)) {
+      const uint32_t lit = state->display_on ? width * sh1107_active_rows(state) : 0;
+      const uint32_t color = sh1107_lit_color(state);
+      for (uint32_t i = 0; i < width * height; i++) {
+        frame[i] = i < lit ? color : 0;
+      }
+      if (width == state->stride) {
+        sh1107_send_pixels(state, 0, 0, frame, width * height);
+      } else {
+        for (uint32_t y = 0; y < height; y++) {
+          sh1107_send_pixels(state, y, 0, &frame[y * width], width);
+        }
+      }
+      state->stats.pixels_rendered += width * height;
+      state->rendered_key = render_key;
+      state->rendered_palette[0] = state->palette[0];
+      state->rendered_palette[1] = state->palette[1];
+      return true;
+    }
+    return false;
+  }
+  const bool full_redraw = render_key != state->rendered_key;
+  const bool recolor = !full_redraw && palette_changed;
+  if (recolor) {
+    sh1107_recolor_frame(state);
+  }
+  state->rendered_palette[0] = state->palette[0];
+  state->rendered_palette[1] = state->palette[1];
+  if (full_redraw) {
+    sh1107_update_mapping(state);
+    for (uint8_t page = 0; page < GDDRAM_PAGES; page++) {
+      state->dirty_column_min[page] = 0;
+      state->dirty_column_max[page] = GDDRAM_COLUMN_MASK;
+    }
+    state->dirty_pages = 0xffff;
+    state->hidden_pages = 0;
+    state->rendered_key = render_key;
+    for (uint8_t page = 0; page < GDDRAM_PAGES; page++) {
+      state->page_version[page]++;
+    }
+  }
+
+  // Output column span touched in each frame row (inclusive), used to limit the buffer_write calls
+  bool row_dirty[GDDRAM_ROWS] = {false};
+  uint8_t row_x0[GDDRAM_ROWS];
+  uint8_t row_x1[GDDRAM_ROWS];
+
+  const uint32_t scroll = sh1107_scroll(state);
+  const uint32_t active_rows = sh1107_active_rows(state);
+  if (scroll != state->rendered_scroll || recolor) {
+    // Scrolling: the rendered rows are still valid, they only need to be sent in a new order.
+    // Rows that were off the panel were never rendered, so their pages are drawn now.
+    // A recolored frame is sent in full the same way.
+    for (uint32_t row = 0; row < GDDRAM_ROWS; row++) {
+      row_dirty[row] = true;
+      row_x0[row] = 0;
+      row_x1[row] = width - 1;
+    }
+    for (uint8_t page = 0; page < GDDRAM_PAGES; page++) {
+      if (state->hidden_pages & (1 << page)) {
+        sh1107_mark_dirty_columns(state, page, 0, GDDRAM_COLUMN_MASK);
+      }
+    }
+    state->hidden_pages = 0;
+    state->rendered_scroll = scroll;
+  } else if (!state->dirty_pages) {
+    // Nothing visible changed since the last frame
+    return false;
+  }
+
+  // Walk the dirty GDDRAM region, expanding each byte into the 8 output rows of its page.
+  // Only the part that lands on the panel is rendered.
+  const sh1107_render_kernel_t render_page = sh1107_render_kernels[state->segment_remap];
+  for (uint8_t page = 0; page < GDDRAM_PAGES; page++) {
+    if (!(state->dirty_pages & (1 << page))) {
+      continue;
+    }
+    uint32_t *rows[8];
+    uint8_t shown_rows = 0;
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      const uint8_t row = row_map[page * 8 + bit];
+      if (((row - scroll) & GDDRAM_ROW_MASK) < active_rows) {
+        rows[bit] = &frame[row * width];
+        shown_rows |= 1 << bit;
+      } else {
+        rows[bit] = state->hidden_row;
+      }
+    }
+    if (shown_rows != 0xff) {
+      state->hidden_pages |= 1 << page;
+      if (!shown_rows) {
+        continue;
+      }
+    }
+
+    const uint8_t column_min = state->dirty_column_min[page];
+    const uint8_t column_max = state->dirty_column_max[page];
+    uint8_t x_min = width - 1;
+    uint8_t x_max = 0;
+    for (uint8_t span = 0; span < state->column_span_count; span++) {
+      const uint8_t first = column_min > state->column_span_first[span] ? column_min : state->column_span_first[span];
+      const uint8_t last = column_max < state->column_span_last[span] ? column_max : state->column_span_last[span];
+      if (first > last) {
+        continue;
+      }
+      render_page(state, rows, page, first, last);
+      state->stats.pixels_rendered += (last - first + 1) * 8;
+      // Spans are contiguous in the output, in either direction depending on the segment remap
+      const uint8_t x0 = column_map[first] < column_map[last] ? column_map[first] : column_map[last];
+      const uint8_t x1 = column_map[first] < column_map[last] ? column_map[last] : column_map[first];
+      x_min = x0 < x_min ? x0 : x_min;
+      x_max = x1 > x_max ? x1 : x_max;
+    }
+    if (x_min > x_max) {
+      continue;
+    }
+    for (uint8_t bit = 0; bit < 8; bit++) {
+      const uint8_t row = row_map[page * 8 + bit];
+      if (!row_dirty[row]) {
+        row_dirty[row] = true;
+        row_x0[row] = x_min;
+        row_x1[row] = x_max;
+      }
+    }
+  }
+
+  sh1107_send_rows(state, row_dirty, row_x0, row_x1);
+  if (full_redraw) {
+    sh1107_blank_inactive_rows(state);
+  }
+  state->dirty_pages = 0;
+  return true;
+}
+
+static void sh1107_print_stats(sh1107_state_t *state)
+{
+  const sh1107_stats_t *stats = &state->stats;
+  printf("SH1107 stats: i2c %u transactions, %u bytes (%u command, %u data); frames %u scheduled, %u rendered, "
+         "%u skipped; %u writes, %llu pixels sent, %llu rendered\n",
+         stats->i2c_transactions, stats->i2c_bytes, stats->command_bytes, stats->data_bytes, stats->frames_scheduled,
+         stats->frames_rendered, stats->frames_skipped, stats->buffer_writes,
+         (unsigned long long)stats->pixels_written, (unsigned long long)stats->pixels_rendered);
+
+  printf("SH1107 commands:");
+  for (uint32_t opcode = 0; opcode < 256; opcode++) {
+    if (stats->commands[opcode]) {
+      printf(" %02x:%u", opcode, stats->commands[opcode]);
+    }
+  }
+  printf("\n");
+}
+
+static void sh1107_stats_timer_callback(void *user_data)
+{
+  sh1107_print_stats(user_data);
+}
+
+#if SH1107_REFERENCE_CHECK
+// Straightforward per-pixel renderer, drawing the display the way the chip originally did.
+// The optimized renderer must produce the exact same image, see sh1107_check_frame() and
+// `dist/bench --check`.
+void sh1107_render_reference(void *chip, uint32_t *image)
+{
+  const sh1107_state_t *state = chip;
   const uint8_t *pixels = state->pixels;
   const uint8_t invert = state->invert;
   const bool display_on = state->display_on;
+  const bool all_on = state->all_on;
   const bool reverse_rows = state->reverse_rows;
+  const bool segment_remap = state->segment_remap;
   const uint8_t start_line = state->start_line;
-  const uint8_t width = state->width;
-  const uint8_t height = state->height;
-  const int8_t x_offset = state->x_offset;
-
-  for (uint8_t y = 0; y < height; y++) {
-    for (uint8_t x = 0; x < width; x++) {
-      const uint32_t scroll_y = y + start_line;
-      const uint32_t virtual_y = (reverse_rows ? height - 1 - scroll_y : scroll_y) % width;
-      const uint32_t pix_index = (virtual_y / 8) * width + (x + x_offset + width) % width;
+  const uint32_t width = state->width;
+  const uint32_t height = state->height;
+  const uint8_t x_offset = state->x_offset;
+  const uint32_t multiplex = state->multiplex_ratio + 1;
+  const uint32_t lit_color = sh1107_lit_color(state);
+
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      if (y >= multiplex) {
+        image[y * width + x] = 0;
+        continue;
+      }
+      const uint32_t scroll_y = y + state->display_offset + start_line;
+      const uint32_t virtual_y = (reverse_rows ? multiplex - 1 - scroll_y : scroll_y) % GDDRAM_ROWS;
+      const uint32_t segment = (x + x_offset) % GDDRAM_COLUMNS;
+      const uint32_t column = segment_remap ? GDDRAM_COLUMNS - 1 - segment : segment;
+      const uint32_t pix_index = (virtual_y / 8) * GDDRAM_COLUMNS + column;
       const bool pixValue = pixels[pix_index] & (1 << virtual_y % 8) ? !invert : invert;
-      const uint32_t data_offset = (y * width + x) * 4;
-      uint32_t pixel = pixValue && display_on ? 0xffffffff : 0;
-      buffer_write(state->framebuffer, data_offset, &pixel, sizeof(pixel));
+      image[y * width + x] = (pixValue || all_on) && display_on ? lit_color : 0;
+    }
+  }
+}
+
+// Reports the first pixel where the host framebuffer differs from the reference renderer
+static void sh1107_check_frame(sh1107_state_t *state)
+{
+  static uint32_t expected[GDDRAM_ROWS * GDDRAM_COLUMNS];
+  const uint32_t width = state->width;
+  const uint32_t count = width * state->height;
+  sh1107_render_reference(state, expected);
+  for (uint32_t i = 0; i < count; i++) {
+    if (state->sent_image[i] != expected[i]) {
+      printf("SH1107 reference check: frame %u differs at (%u, %u): %08x instead of %08x\n",
+             state->stats.frames_rendered, i % width, i / width, state->sent_image[i], expected[i]);
+      return;
+    }
+  }
+}
+#endif
+
+static uint32_t sh1107_capture_varint(uint8_t *target, uint64_t value)
+{
+  uint32_t length = 0;
+  do {
+    target[length++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+    value >>= 7;
+  } while (value);
+  return length;
+}
+
+static void sh1107_capture_print(const sh1107_state_t *state, const uint8_t *record, uint32_t length)
+{
+  static const char hex[] = "0123456789abcdef";
+  // Worst case: alternating changed and unchanged bytes take 3 bytes each
+  static char line[(16 + CAPTURE_SETTINGS_SIZE + 3 * GDDRAM_PAGES * GDDRAM_COLUMNS) * 2 + 1];
+  for (uint32_t i = 0; i < length; i++) {
+    line[i * 2] = hex[record[i] >> 4];
+    line[i * 2 + 1] = hex[record[i] & 0xf];
+  }
+  line[length * 2] = 0;
+  printf(CAPTURE_LINE_PREFIX "%02x: %s\n", state->address, line);
+}
+
+// Prints the frames captured since the last flush, in the format of sh1107-capture.h.
+// Each one is XORed with the previous frame, which the ring buffer always still holds.
+static void sh1107_capture_flush(sh1107_state_t *state)
+{
+  static uint8_t record[16 + CAPTURE_SETTINGS_SIZE + 3 * GDDRAM_PAGES * GDDRAM_COLUMNS];
+  static const uint8_t empty[GDDRAM_PAGES * GDDRAM_COLUMNS];
+  if (!state->capture_exported) {
+    const uint8_t header[] = {CAPTURE_HEADER, CAPTURE_VERSION, state->width, state->height};
+    sh1107_capture_print(state, header, sizeof(header));
+  }
+  for (; state->capture_exported < state->capture_count; state->capture_exported++) {
+    const uint32_t index = state->capture_exported;
+    const sh1107_capture_t *frame = &state->captures[index % SH1107_CAPTURE_FRAMES];
+    const sh1107_capture_t *previous = index ? &state->captures[(index - 1) % SH1107_CAPTURE_FRAMES] : NULL;
+    const uint8_t *base = previous ? previous->pixels : empty;
+
+    uint32_t length = 0;
+    record[length++] = CAPTURE_FRAME;
+    length += sh1107_capture_varint(&record[length], frame->nanos - (previous ? previous->nanos : 0));
+    memcpy(&record[length], frame->settings, CAPTURE_SETTINGS_SIZE);
+    length += CAPTURE_SETTINGS_SIZE;
+    for (uint32_t i = 0; i < sizeof(frame->pixels);) {
+      const uint32_t unchanged = i;
+      while (i < sizeof(frame->pixels)) {
+        const uint32_t page = i / GDDRAM_COLUMNS;
+        if (i % GDDRAM_COLUMNS == 0 && previous && frame->page_version[page] == previous->page_version[page]) {
+          // The page was not touched since the previous frame
+          i += GDDRAM_COLUMNS;
+        } else if (frame->pixels[i] == base[i]) {
+          i++;
+        } else {
+          break;
+        }
+      }
+      length += sh1107_capture_varint(&record[length], i - unchanged);
+      if (i == sizeof(frame->pixels)) {
+        break;
+      }
+      const uint32_t changed = i;
+      while (i < sizeof(frame->pixels) && frame->pixels[i] != base[i]) {
+        i++;
+      }
+      length += sh1107_capture_varint(&record[length], i - changed);
+      for (uint32_t j = changed; j < i; j++) {
+        record[length++] = frame->pixels[j] ^ base[j];
+      }
     }
+    sh1107_capture_print(state, record, length);
+  }
+}
+
+static void sh1107_capture_timer_callback(void *user_data)
+{
+  sh1107_state_t *state = user_data;
+  if (state->capture_exported != state->capture_count) {
+    sh1107_capture_flush(state);
+  }
+}
+
+// Stores a rendered frame in the capture ring buffer: the GDDRAM (1 bit per pixel) and
+// the settings it is shown with, rather than the 64 KB of RGBA pixels. The ring is
+// flushed before it wraps around, keeping the last printed frame as the XOR base, and
+// every CAPTURE_FLUSH_INTERVAL.
+static void sh1107_capture_frame(sh1107_state_t *state)
+{
+  sh1107_capture_t *frame = &state->captures[state->capture_count % SH1107_CAPTURE_FRAMES];
+  frame->nanos = get_sim_nanos();
+  frame->settings[CAPTURE_SETTINGS_FLAGS] =
+      (state->display_on ? CAPTURE_FLAG_DISPLAY_ON : 0) | (state->all_on ? CAPTURE_FLAG_ALL_ON : 0) |
+      (state->invert ? CAPTURE_FLAG_INVERT : 0) | (state->reverse_rows ? CAPTURE_FLAG_COM_REVERSE : 0) |
+      (state->segment_remap ? CAPTURE_FLAG_SEGMENT_REMAP : 0);
+  frame->settings[CAPTURE_SETTINGS_CONTRAST] = state->contrast;
+  frame->settings[CAPTURE_SETTINGS_START_LINE] = state->start_line;
+  frame->settings[CAPTURE_SETTINGS_DISPLAY_OFFSET] = state->display_offset;
+  frame->settings[CAPTURE_SETTINGS_MULTIPLEX] = state->multiplex_ratio;
+  frame->settings[CAPTURE_SETTINGS_X_OFFSET] = state->x_offset;
+  // An open data burst has already written to the GDDRAM, but its pages are only marked
+  // dirty when it ends: they may differ from the previous frame
+  for (uint8_t page = 0; page < GDDRAM_PAGES; page++) {
+    if (state->burst_pages & (1 << page)) {
+      state->page_version[page]++;
+    }
+  }
+  memcpy(frame->page_version, state->page_version, sizeof(frame->page_version));
+  memcpy(frame->pixels, state->pixels, sizeof(frame->pixels));
+  state->capture_count++;
+
+  if (state->capture_count - state->capture_exported == SH1107_CAPTURE_FRAMES - 1) {
+    sh1107_capture_flush(state);
+  }
+}
+
+void sh1107_update_buffer(void *user_data) {
+  sh1107_state_t *state = user_data;
+  if (sh1107_render_frame(state)) {
+    state->stats.frames_rendered++;
+#if SH1107_REFERENCE_CHECK
+    if (state->reference_check) {
+      sh1107_check_frame(state);
+    }
+#endif
+    if (state->capture_enabled) {
+      sh1107_capture_frame(state);
+    }
+    if (state->stats_frames && state->stats.frames_rendered % state->stats_frames == 0) {
+      sh1107_print_stats(state);
+    }
+  } else {
+    state->stats.frames_skipped++;
   }
   state->updated = false;
+  state->present_on_stop = false;
+  state->last_frame_nanos = get_sim_nanos();
+}
+
+// Adaptive refresh: when a new frame is requested within one interval of the previous
+// frame (e.g. an animation streaming data continuously), skip frames by doubling the
+// interval, up to ADAPTIVE_REFRESH_MAX_FACTOR. Go back to the full rate after two idle
+// intervals. The simulated clock does not advance while the chip renders, so the render
+// cost cannot be compared with the time spent receiving data. Instead, back-to-back frame
+// requests are taken as the sign that rendering, which is paid per frame, dominates.
+static void sh1107_adapt_frame_interval(sh1107_state_t *state)
+{
+  if (!state->last_frame_nanos) {
+    // Nothing rendered since chip_init()
+    return;
+  }
+  const uint64_t idle_nanos = get_sim_nanos() - state->last_frame_nanos;
+  const uint64_t interval_nanos = state->frame_interval * 1000ULL;
+  const uint32_t max_interval = state->refresh_interval * ADAPTIVE_REFRESH_MAX_FACTOR;
+  if (idle_nanos < interval_nanos) {
+    state->frame_interval = state->frame_interval * 2 < max_interval ? state->frame_interval * 2 : max_interval;
+  } else if (idle_nanos > 2 * interval_nanos) {
+    state->frame_interval = state->refresh_interval;
+  }
 }
 
 void sh1107_schedule_update(sh1107_state_t *state) {
   if (!state->updated) {
     state->updated = true;
-    timer_start(state->update_timer, 16667, false); // 16.667 millis for ~60 MHz
+    state->stats.frames_scheduled++;
+    if (!state->refresh_interval) {
+      // Rendered when the I2C transaction ends, see sh1107_i2c_disconnect()
+      return;
+    }
+    if (state->low_latency && get_sim_nanos() - state->last_frame_nanos >= state->frame_interval * 1000ULL) {
+      // First change after an idle period: don't wait for the timer, present it as soon
+      // as the I2C transaction ends. The timer still runs in case no stop condition comes.
+      state->present_on_stop = true;
+    } else if (state->adaptive_refresh) {
+      sh1107_adapt_frame_interval(state);
+    }
+    timer_start(state->update_timer, state->frame_interval, false);
   }
 }
 
-static void sh1107_process_command(sh1107_state_t *state)
+// Panel timing mode (panelTiming attribute): refresh at the frame rate the controller would
+// drive the panel at, from the datasheet formula Ffrm = Fosc / (D x K x MUX), where D is the
+// clock divide ratio and K = phase1 + phase2 + ROW_OVERHEAD_CLOCKS the display clocks per row.
+// Called whenever one of these registers changes.
+static void sh1107_update_panel_timing(sh1107_state_t *state)
 {
-  uint8_t command_code = state->current_command[0];
-  bool auto_update = false;
-  switch (command_code)
-  {
-  case CMD_SET_CONTRAST:
-    state->contrast = state->current_command[1];
-    auto_update = true;
-    break;
+  if (!state->panel_timing) {
+    return;
+  }
+  const uint64_t oscillator = OSCILLATOR_FREQUENCY * (75ULL + 5 * state->oscillator_frequency) / 100;
+  const uint32_t phase1 = state->phase1 ? state->phase1 : 1; // 0 is invalid, the controller uses 1
+  const uint32_t phase2 = state->phase2 ? state->phase2 : 1;
+  const uint64_t frame_clocks =
+      (uint64_t)state->clock_divider * (phase1 + phase2 + ROW_OVERHEAD_CLOCKS) * (state->multiplex_ratio + 1);
+  state->refresh_interval = frame_clocks * 1000000 / oscillator;
+  state->frame_interval = state->refresh_interval;
+}
 
-  case CMD_DISPLAY_OFF:
-    state->display_on = false;
-    sh1107_schedule_update(state);
-    break;
+// Command handlers. `command` holds the opcode followed by its parameter bytes.
 
-  case CMD_DISPLAY_ON:
-    state->display_on = true;
-    sh1107_schedule_update(state);
-    break;
+static void sh1107_cmd_unknown(sh1107_state_t *state, const uint8_t *command)
+{
+  // Drivers for a slightly different controller may send these constantly, so only
+  // report each opcode once, and then every UNKNOWN_COMMAND_REPORT_EVERY occurrences.
+  const uint32_t count = state->stats.commands[command[0]];
+  if (count == 1) {
+    printf("Unknown SH1107 Command %02x\n", command[0]);
+  } else if (count % UNKNOWN_COMMAND_REPORT_EVERY == 0) {
+    printf("Unknown SH1107 Command %02x received %u times\n", command[0], count);
+  }
+}
 
-  case CMD_NORMAL_DISPLAY:
-    state->invert = false;
-    auto_update = true;
-    break;
+static void sh1107_cmd_ignore(sh1107_state_t *state, const uint8_t *command)
+{
+  // NOP, or a command that is not implemented
+}
 
-  case CMD_INVERT_DISPLAY:
-    state->invert = true;
-    auto_update = true;
-    break;
+static void sh1107_cmd_set_lower_column(sh1107_state_t *state, const uint8_t *command)
+{
+  state->active_column = (state->active_column & 0x70) | (command[0] & 0x0f);
+}
 
-  case CMD_NOP:
-    break;
+static void sh1107_cmd_set_higher_column(sh1107_state_t *state, const uint8_t *command)
+{
+  state->active_column = (state->active_column & 0x0f) | ((command[0] & 0x07) << 4);
+}
 
-  case CMD_SET_PAGE_ADDR_MODE:
-  case CMD_SET_VERTICAL_ADDR_MODE:
-    state->memory_mode = state->current_command[0];
-    break;
+static void sh1107_cmd_set_page(sh1107_state_t *state, const uint8_t *command)
+{
+  state->active_page = command[0] & 0x0f;
+}
 
-  case CMD_SET_DISPLAY_CLOCK_DIV:
-    state->clock_divider = 1 + (state->current_command[1] & 0xf);
-    break;
+static void sh1107_cmd_set_memory_mode(sh1107_state_t *state, const uint8_t *command)
+{
+  state->memory_mode = command[0];
+}
 
-  case CMD_SET_PRECHARGE:
-    state->phase1 = state->current_command[1] & 0xf;
-    state->phase2 = (state->current_command[1] >> 4) & 0xf;
-    break;
+static void sh1107_cmd_set_contrast(sh1107_state_t *state, const uint8_t *command)
+{
+  state->contrast = command[1];
+}
 
-  case CMD_COM_SCAN_INC:
-    state->reverse_rows = false;
-    auto_update = true;
-    break;
+static void sh1107_cmd_set_segment_remap(sh1107_state_t *state, const uint8_t *command)
+{
+  state->segment_remap = command[0] == CMD_SEG_REMAP_ON;
+}
 
-  case CMD_COM_SCAN_DEC:
-    state->reverse_rows = true;
-    auto_update = true;
-    break;
+static void sh1107_cmd_set_all_on(sh1107_state_t *state, const uint8_t *command)
+{
+  state->all_on = command[0] == CMD_DISPLAY_ALL_ON;
+}
 
-  case CMD_SEG_REMAP_OFF:
-    state->segment_remap = false;
-    auto_update = true;
-    break;
+static void sh1107_cmd_set_invert(sh1107_state_t *state, const uint8_t *command)
+{
+  state->invert = command[0] == CMD_INVERT_DISPLAY;
+}
 
-  case CMD_SEG_REMAP_ON:
-    state->segment_remap = true;
-    auto_update = true;
-    break;
+static void sh1107_cmd_set_display_on(sh1107_state_t *state, const uint8_t *command)
+{
+  state->display_on = command[0] == CMD_DISPLAY_ON;
+}
 
-  case CMD_SET_DISP_START_LINE:
-    state->start_line = state->current_command[1];
-    auto_update = true;
-    break;
+static void sh1107_cmd_read_modify_write(sh1107_state_t *state, const uint8_t *command)
+{
+  state->read_modify_write = true;
+  state->rmw_column = state->active_column;
+}
 
-  case CMD_SET_DISPLAY_OFFSET: 
-  case CMD_SET_MULTIPLEX:
-  case CMD_SET_VCOM_DESELECT:
-  case CMD_SET_COM_PINS:
-  case CMD_DISPLAY_ALL_ON:
-  case CMD_DISPLAY_ALL_ON_RESUME:
-    // not implemented
-    break;
+static void sh1107_cmd_end(sh1107_state_t *state, const uint8_t *command)
+{
+  if (state->read_modify_write) {
+    state->read_modify_write = false;
+    state->active_column = state->rmw_column;
+  }
+}
 
-  default:
-    if (command_code <= 0x0f)
-    {
-      state->active_column = (state->active_column & 0x70) | command_code;
-      break;
-    }
+static void sh1107_cmd_set_com_scan(sh1107_state_t *state, const uint8_t *command)
+{
+  state->reverse_rows = command[0] == CMD_COM_SCAN_DEC;
+}
 
-    if (command_code >= 0x10 && command_code <= 0x17)
-    {
-      state->active_column = (state->active_column & 0x0f) | ((command_code & 0x07) << 4);
-      break;
-    }
+static void sh1107_cmd_set_clock_div(sh1107_state_t *state, const uint8_t *command)
+{
+  state->clock_divider = 1 + (command[1] & 0xf);
+  state->oscillator_frequency = command[1] >> 4;
+  sh1107_update_panel_timing(state);
+}
 
-    if (command_code >= 0xb0 && command_code <= 0xc0)
-    {
-      state->active_page = command_code & 0x0f;
-      auto_update = true;
-      break;
-    }
+static void sh1107_cmd_set_precharge(sh1107_state_t *state, const uint8_t *command)
+{
+  state->phase1 = command[1] & 0xf;
+  state->phase2 = (command[1] >> 4) & 0xf;
+  sh1107_update_panel_timing(state);
+}
 
-    printf("Unknown SH1107 Command %02x\n", command_code);
-  }
+static void sh1107_cmd_set_start_line(sh1107_state_t *state, const uint8_t *command)
+{
+  state->start_line = command[1];
+}
 
-  if (auto_update && state->display_on)
-  {
-    sh1107_schedule_update(state);
-  }
+static void sh1107_cmd_set_multiplex(sh1107_state_t *state, const uint8_t *command)
+{
+  state->multiplex_ratio = command[1] & 0x7f;
+  sh1107_update_panel_timing(state);
+}
+
+static void sh1107_cmd_set_display_offset(sh1107_state_t *state, const uint8_t *command)
+{
+  state->display_offset = command[1] & 0x7f;
+}
+
+typedef struct
+{
+  uint8_t params; // number of parameter bytes following the opcode
+  uint8_t flags;  // COMMAND_AFFECTS_* flags
+  void (*handler)(sh1107_state_t *state, const uint8_t *command);
+} sh1107_command_t;
+
+#define COMMAND(params, flags, handler) {params, flags, sh1107_cmd_##handler}
+#define UNKNOWN_COMMAND COMMAND(0, 0, unknown)
+
+// Descriptor for every opcode, indexed by the first command byte
+static const sh1107_command_t sh1107_commands[256] = {
+    [0x00 ... 0x0f] = COMMAND(0, COMMAND_AFFECTS_ADDRESS, set_lower_column),
+    [0x10 ... 0x17] = COMMAND(0, COMMAND_AFFECTS_ADDRESS, set_higher_column),
+    [0x18 ... 0x1f] = UNKNOWN_COMMAND,
+    [CMD_SET_PAGE_ADDR_MODE] = COMMAND(0, COMMAND_AFFECTS_ADDRESS, set_memory_mode),
+    [CMD_SET_VERTICAL_ADDR_MODE] = COMMAND(0, COMMAND_AFFECTS_ADDRESS, set_memory_mode),
+    [0x22 ... 0x80] = UNKNOWN_COMMAND,
+    [CMD_SET_CONTRAST] = COMMAND(1, COMMAND_AFFECTS_RENDER, set_contrast),
+    [0x82 ... 0x9f] = UNKNOWN_COMMAND,
+    [CMD_SEG_REMAP_OFF] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_segment_remap),
+    [CMD_SEG_REMAP_ON] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_segment_remap),
+    [0xa2 ... 0xa3] = UNKNOWN_COMMAND,
+    [CMD_DISPLAY_ALL_ON_RESUME] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_all_on),
+    [CMD_DISPLAY_ALL_ON] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_all_on),
+    [CMD_NORMAL_DISPLAY] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_invert),
+    [CMD_INVERT_DISPLAY] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_invert),
+    [CMD_SET_MULTIPLEX] = COMMAND(1, COMMAND_AFFECTS_RENDER, set_multiplex),
+    [0xa9 ... 0xac] = UNKNOWN_COMMAND,
+    [CMD_DCDC] = COMMAND(1, 0, ignore),
+    [CMD_DISPLAY_OFF] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_display_on),
+    [CMD_DISPLAY_ON] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_display_on),
+    [0xb0 ... 0xbf] = COMMAND(0, COMMAND_AFFECTS_ADDRESS, set_page),
+    [CMD_COM_SCAN_INC] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_com_scan),
+    [0xc1 ... 0xc7] = UNKNOWN_COMMAND,
+    [CMD_COM_SCAN_DEC] = COMMAND(0, COMMAND_AFFECTS_RENDER, set_com_scan),
+    [0xc9 ... 0xd2] = UNKNOWN_COMMAND,
+    [CMD_SET_DISPLAY_OFFSET] = COMMAND(1, COMMAND_AFFECTS_RENDER, set_display_offset),
+    [0xd4] = UNKNOWN_COMMAND,
+    [CMD_SET_DISPLAY_CLOCK_DIV] = COMMAND(1, 0, set_clock_div),
+    [0xd6 ... 0xd8] = UNKNOWN_COMMAND,
+    [CMD_SET_PRECHARGE] = COMMAND(1, 0, set_precharge),
+    [CMD_SET_COM_PINS] = COMMAND(1, 0, ignore),
+    [CMD_SET_VCOM_DESELECT] = COMMAND(1, 0, ignore),
+    [CMD_SET_DISP_START_LINE] = COMMAND(1, COMMAND_AFFECTS_RENDER, set_start_line),
+    [0xdd ... 0xdf] = UNKNOWN_COMMAND,
+    [CMD_READ_MODIFY_WRITE] = COMMAND(0, COMMAND_AFFECTS_ADDRESS, read_modify_write),
+    [0xe1 ... 0xe2] = UNKNOWN_COMMAND,
+    [CMD_NOP] = COMMAND(0, 0, ignore),
+    [0xe4 ... 0xed] = UNKNOWN_COMMAND,
+    [CMD_END] = COMMAND(0, COMMAND_AFFECTS_ADDRESS, end),
+    [0xef ... 0xff] = UNKNOWN_COMMAND,
+};
+
+// Runs the complete command in current_command, and returns its COMMAND_AFFECTS_* flags
+static uint8_t sh1107_execute_command(sh1107_state_t *state)
+{
+  const sh1107_command_t *command = &sh1107_commands[state->current_command[0]];
+  state->stats.commands[state->current_command[0]]++;
+  command->handler(state, state->current_command);
 
   // Reset command buffer index, ready to read the next command
   state->current_command_index = 0;
+  return command->flags;
 }
 
-static void sh1107_process_data(sh1107_state_t *state, uint8_t value)
+static void sh1107_process_command(sh1107_state_t *state)
+{
+  if (sh1107_execute_command(state) & COMMAND_AFFECTS_RENDER)
+  {
+    sh1107_schedule_update(state);
+  }
+}
+
+// Decodes a batch of command bytes, queued by sh1107_burst_command(). A command may
+// continue from the previous batch. An address command immediately followed by another
+// one with the same handler (e.g. two page sets) is skipped, as the second one replaces
+// its effect, and the update is scheduled once for the whole batch.
+static void sh1107_process_command_queue(sh1107_state_t *state, uint32_t count)
 {
-  uint32_t column = !state->segment_remap ? state->active_column : state->width - 1 - state->active_column;
-  uint32_t target = state->active_page * state->width + column;
-  state->pixels[target] = value;
+  const uint8_t *queue = state->command_queue;
+  uint8_t flags = 0;
+  for (uint32_t i = 0; i < count; i++) {
+    const uint8_t value = queue[i];
+    if (!state->current_command_index) {
+      const sh1107_command_t *command = &sh1107_commands[value];
+      if ((command->flags & COMMAND_AFFECTS_ADDRESS) && i + 1 < count &&
+          sh1107_commands[queue[i + 1]].handler == command->handler) {
+        state->stats.commands[value]++;
+        continue;
+      }
+      state->current_command_length = 1 + command->params;
+    }
+    state->current_command[state->current_command_index++] = value;
+    if (state->current_command_index == state->current_command_length) {
+      flags |= sh1107_execute_command(state);
+    }
+  }
+  state->stats.i2c_bytes += count;
+  state->stats.command_bytes += count;
+  if (flags & COMMAND_AFFECTS_RENDER) {
+    sh1107_schedule_update(state);
+  }
+}
 
+// Moves the address counters to the next GDDRAM byte
+static void sh1107_advance_address(sh1107_state_t *state)
+{
   // Memory modes are explained in pages 34-35 of the datasheet,
   // and determine how the order of writing the pixels to the
   // display RAM.
   switch (state->memory_mode)
   {
   case CMD_SET_PAGE_ADDR_MODE:
-    state->active_column++;
-    if (state->active_column >= state->width) {
-      state->active_column = 0;
-    }
+    state->active_column = (state->active_column + 1) & GDDRAM_COLUMN_MASK;
     break;
 
   case CMD_SET_VERTICAL_ADDR_MODE:
   default:
     state->active_page++;
-    if (state->active_page >= 0x10)
+    if (state->active_page >= GDDRAM_PAGES)
     {
       state->active_page = 0;
-      state->active_column++;
-      if (state->active_column >= state->width) {
-        state->active_column = 0;
-      }
+      state->active_column = (state->active_column + 1) & GDDRAM_COLUMN_MASK;
     }
     break;
   }
-  sh1107_schedule_update(state);
 }
 
-static bool sh1107_i2c_connect(void *user_data, uint32_t address, bool connect)
+static void sh1107_process_data(sh1107_state_t *state, uint8_t value)
+{
+  uint32_t target = state->active_page * GDDRAM_COLUMNS + state->active_column;
+  if (state->pixels[target] != value) {
+    state->pixels[target] = value;
+    sh1107_mark_dirty(state, state->active_page, state->active_column);
+    if (sh1107_shows_gddram(state)) {
+      sh1107_schedule_update(state);
+    }
+  }
+  sh1107_advance_address(state);
+}
+
+// Reads the firmware's display buffer, and marks the GDDRAM bytes that changed as dirty
+static void sh1107_mcu_timer_callback(void *user_data)
 {
   sh1107_state_t *state = user_data;
+  const uint8_t *buffer = state->mcu_buffer;
+  if (state->mcu_buffer_indirect) {
+    // _mcu_read_ptr() always reads 32 bits: drop the bytes following a narrower pointer
+    uintptr_t pointer = (uintptr_t)_mcu_read_ptr(buffer);
+    if (state->mcu_pointer_size < sizeof(pointer)) {
+      pointer &= ((uintptr_t)1 << state->mcu_pointer_size * 8) - 1;
+    }
+    buffer = (const uint8_t *)pointer;
+    if (!buffer) {
+      // Not allocated yet, e.g. before Adafruit_SH110X::begin()
+      return;
+    }
+  }
+  const uint32_t columns = state->mcu_buffer_columns;
+  if (!_mcu_read_memory(buffer, state->mcu_snapshot, columns * state->mcu_buffer_pages)) {
+    return;
+  }
+
+  bool changed = false;
+  for (uint32_t page = 0; page < state->mcu_buffer_pages; page++) {
+    const uint8_t *source = &state->mcu_snapshot[page * columns];
+    uint8_t *target = &state->pixels[page * GDDRAM_COLUMNS];
+    for (uint32_t column = 0; column < columns; column++) {
+      if (target[column] != source[column]) {
+        target[column] = source[column];
+        sh1107_mark_dirty(state, page, column);
+        changed = true;
+      }
+    }
+  }
+  if (changed && sh1107_shows_gddram(state)) {
+    if (!state->updated) {
+      state->stats.frames_scheduled++;
+    }
+    timer_stop(state->update_timer);
+    sh1107_update_buffer(state);
+  }
+}
+
+static void sh1107_mcu_init(sh1107_state_t *state)
+{
+  state->mcu_buffer = NULL;
+  const string_t symbol_attr = attr_string_init("mcuBuffer");
+  char symbol[MCU_SYMBOL_LENGTH];
+  if (!string_read(symbol_attr, symbol, sizeof(symbol))) {
+    return;
+  }
+  const uint8_t *address = _symbol_resolve(symbol);
+  if (!address) {
+    printf("SH1107: mcuBuffer symbol %s not found, reading the display data from I2C\n", symbol);
+    return;
+  }
+  state->mcu_snapshot = sh1107_pool_take(sh1107_mcu_snapshots, &sh1107_mcu_snapshot_count, SH1107_MAX_MCU_BUFFERS,
+                                         sizeof(sh1107_mcu_snapshots[0]), "mcuBuffer");
+  if (!state->mcu_snapshot) {
+    return;
+  }
+
+  state->mcu_buffer = address + attr_read(attr_init("mcuBufferOffset", 0));
+  state->mcu_buffer_indirect = attr_read(attr_init("mcuBufferIndirect", false));
+  state->mcu_pointer_size = attr_read(attr_init("mcuBufferPointerSize", 4));
+  if (state->mcu_pointer_size < 1 || state->mcu_pointer_size > 4) {
+    state->mcu_pointer_size = 4;
+  }
+  state->mcu_buffer_columns = attr_read(attr_init("mcuBufferColumns", GDDRAM_COLUMNS));
+  state->mcu_buffer_pages = attr_read(attr_init("mcuBufferPages", GDDRAM_PAGES));
+  if (state->mcu_buffer_columns > GDDRAM_COLUMNS) {
+    state->mcu_buffer_columns = GDDRAM_COLUMNS;
+  }
+  if (state->mcu_buffer_pages > GDDRAM_PAGES) {
+    state->mcu_buffer_pages = GDDRAM_PAGES;
+  }
+
+  const timer_config_t mcu_timer_config = {
+    .callback = sh1107_mcu_timer_callback,
+    .user_data = state,
+  };
+  state->mcu_timer = timer_init(&mcu_timer_config);
+  timer_start(state->mcu_timer, state->refresh_interval ? state->refresh_interval : DEFAULT_REFRESH_INTERVAL,
+              true);
+}
+
+// Command burst: the bytes are queued, and decoded when the queue is full or the burst ends
+static void sh1107_burst_command(void *user_data, uint8_t value)
+{
+  sh1107_state_t *state = user_data;
+  if (state->burst_count == COMMAND_QUEUE_SIZE) {
+    sh1107_process_command_queue(state, COMMAND_QUEUE_SIZE);
+    state->burst_count = 0;
+  }
+  state->command_queue[state->burst_count++] = value;
+}
+
+// Data bursts while the GDDRAM content comes from the MCU memory are only counted
+static void sh1107_burst_ignore(void *user_data, uint8_t value)
+{
+  sh1107_state_t *state = user_data;
+  state->burst_count++;
+}
+
+static void sh1107_burst_page_mode(void *user_data, uint8_t value)
+{
+  sh1107_state_t *state = user_data;
+  uint8_t *target = state->burst_target++;
+  state->burst_changed |= *target ^ value;
+  *target = value;
+  state->burst_count++;
+  if (state->burst_target == &state->pixels[(state->active_page + 1) * GDDRAM_COLUMNS]) {
+    // The column address wraps around within the page
+    state->burst_target -= GDDRAM_COLUMNS;
+  }
+}
+
+static void sh1107_burst_vertical_mode(void *user_data, uint8_t value)
+{
+  sh1107_state_t *state = user_data;
+  uint8_t *target = state->burst_target;
+  state->burst_changed |= *target ^ value;
+  *target = value;
+  state->burst_count++;
+  target += GDDRAM_COLUMNS;
+  if (target >= state->pixels + sizeof(state->pixels)) {
+    // Past the last page: continue at the top of the next column
+    target -= sizeof(state->pixels) - 1;
+    if (target == &state->pixels[GDDRAM_COLUMNS]) {
+      target = state->pixels;
+    }
+  }
+  state->burst_target = target;
+}
+
+static void sh1107_begin_command_burst(sh1107_state_t *state)
+{
+  state->burst_count = 0;
+  state->burst_write = sh1107_burst_command;
+}
+
+static void sh1107_begin_burst(sh1107_state_t *state)
+{
+  state->burst_target = &state->pixels[state->active_page * GDDRAM_COLUMNS + state->active_column];
+  state->burst_count = 0;
+  state->burst_changed = 0;
+  if (state->memory_mode == CMD_SET_PAGE_ADDR_MODE) {
+    state->burst_write = sh1107_burst_page_mode;
+    state->burst_pages = 1 << state->active_page;
+  } else {
+    state->burst_write = sh1107_burst_vertical_mode;
+    state->burst_pages = 0xffff;
+  }
+  if (state->mcu_buffer) {
+    state->burst_write = sh1107_burst_ignore;
+    state->burst_pages = 0;
+  }
+}
+
+// Moves the address counters past the burst, and marks the written region dirty
+static void sh1107_end_burst(sh1107_state_t *state)
+{
+  if (!state->burst_write) {
+    return;
+  }
+  if (state->burst_write == sh1107_burst_command) {
+    state->burst_write = NULL;
+    sh1107_process_command_queue(state, state->burst_count);
+    return;
+  }
+  const uint32_t width = GDDRAM_COLUMNS;
+  const uint32_t pages = GDDRAM_PAGES;
+  const uint32_t count = state->burst_count;
+  const uint32_t column = state->active_column;
+  const uint32_t page = state->active_page;
+
+  state->stats.i2c_bytes += count;
+  state->stats.data_bytes += count;
+  state->burst_pages = 0;
+  if (state->burst_write == sh1107_burst_ignore) {
+    state->burst_write = NULL;
+    return;
+  }
+  if (state->burst_write == sh1107_burst_page_mode) {
+    state->active_column = (column + count) & GDDRAM_COLUMN_MASK;
+    if (state->burst_changed) {
+      const uint32_t last_column = column + count - 1;
+      if (count >= width || last_column >= width) {
+        sh1107_mark_dirty_columns(state, page, 0, width - 1);
+      } else {
+        sh1107_mark_dirty_columns(state, page, column, last_column);
+      }
+    }
+  } else {
+    const uint32_t end = column * pages + page + count;
+    state->active_column = (end / pages) & GDDRAM_COLUMN_MASK;
+    state->active_page = end & (pages - 1);
+    if (state->burst_changed) {
+      const uint32_t last_column = column + (page + count - 1) / pages;
+      for (uint32_t p = 0; p < pages; p++) {
+        if (last_column == column && (p < page || p >= page + count)) {
+          continue;
+        }
+        if (last_column - column >= width - 1 || last_column >= width) {
+          sh1107_mark_dirty_columns(state, p, 0, width - 1);
+        } else {
+          sh1107_mark_dirty_columns(state, p, column, last_column);
+        }
+      }
+    }
+  }
+
+  if (state->burst_changed && sh1107_shows_gddram(state)) {
+    sh1107_schedule_update(state);
+  }
+  state->burst_write = NULL;
+}
+
+static void sh1107_trace_flush(sh1107_state_t *state)
+{
+  static const char hex[] = "0123456789abcdef";
+  char line[TRACE_LINE_BYTES * 2 + 1];
+  for (uint32_t offset = 0; offset < state->trace_length; offset += TRACE_LINE_BYTES) {
+    uint32_t count = state->trace_length - offset;
+    if (count > TRACE_LINE_BYTES) {
+      count = TRACE_LINE_BYTES;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      line[i * 2] = hex[state->trace[offset + i] >> 4];
+      line[i * 2 + 1] = hex[state->trace[offset + i] & 0xf];
+    }
+    line[count * 2] = 0;
+    printf(TRACE_LINE_PREFIX "%02x: %s\n", state->address, line);
+  }
+  state->trace_length = 0;
+  state->trace_write_record = 0;
+  state->trace_records = 0;
+}
+
+// Prints the tail of the trace, which would otherwise stay in the buffer until it fills up
+static void sh1107_trace_timer_callback(void *user_data)
+{
+  sh1107_state_t *state = user_data;
+  if (state->trace_records) {
+    sh1107_trace_flush(state);
+  }
+}
+
+static void sh1107_trace_event(sh1107_state_t *state, uint8_t tag)
+{
+  // tag + up to 10 varint bytes + up to 2 payload bytes
+  if (state->trace_length + 13 > TRACE_BUFFER_SIZE) {
+    sh1107_trace_flush(state);
+  }
+  const uint64_t now = get_sim_nanos();
+  uint64_t delta = now - state->trace_nanos;
+  state->trace_nanos = now;
+  state->trace_write_record = 0;
+  state->trace_records++;
+  state->trace[state->trace_length++] = tag;
+  do {
+    state->trace[state->trace_length++] = (delta & 0x7f) | (delta > 0x7f ? 0x80 : 0);
+    delta >>= 7;
+  } while (delta);
+}
+
+static void sh1107_trace_write(sh1107_state_t *state, uint8_t value)
+{
+  // Consecutive bytes share a TRACE_WRITE record, up to 255 of them
+  if (!state->trace_write_record || state->trace[state->trace_write_record] == 0xff ||
+      state->trace_length == TRACE_BUFFER_SIZE) {
+    sh1107_trace_event(state, TRACE_WRITE);
+    state->trace_write_record = state->trace_length;
+    state->trace[state->trace_length++] = 0;
+  }
+  state->trace[state->trace_length++] = value;
+  state->trace[state->trace_write_record]++;
+}
+
+static void sh1107_trace_init(sh1107_state_t *state)
+{
+  memcpy(state->trace, TRACE_MAGIC, 4);
+  state->trace[4] = TRACE_VERSION;
+  state->trace_length = 5;
+  state->trace_write_record = 0;
+  state->trace_nanos = 0;
+}
+
+static bool sh1107_i2c_connect(void *user_data, uint32_t address, bool read)
+{
+  sh1107_state_t *state = user_data;
+  if (state->trace_enabled)
+  {
+    sh1107_trace_event(state, TRACE_START);
+    state->trace[state->trace_length++] = address << 1 | read;
+  }
+  sh1107_end_burst(state);
   state->control_byte = true;
+  state->stats.i2c_transactions++;
   return true;
 }
 
+static void sh1107_i2c_disconnect(void *user_data)
+{
+  sh1107_state_t *state = user_data;
+  if (state->trace_enabled)
+  {
+    sh1107_trace_event(state, TRACE_STOP);
+  }
+  sh1107_end_burst(state);
+  if (state->updated && (!state->refresh_interval || state->present_on_stop)) {
+    timer_stop(state->update_timer);
+    sh1107_update_buffer(state);
+  }
+}
+
 static uint8_t sh1107_i2c_read(void *user_data)
 {
-  return 0xff; // TODO
+  sh1107_state_t *state = user_data;
+  if (state->trace_enabled)
+  {
+    sh1107_trace_event(state, TRACE_READ);
+  }
+  state->stats.i2c_bytes++;
+  if (state->command_mode) {
+    // The last control byte had D/C=0: status read
+    return state->display_on ? 0 : SH1107_STATUS_DISPLAY_OFF;
+  }
+
+  // Display data reads go through a latch, loaded with the byte at the address counters:
+  // the first read after setting the address returns stale data (the datasheet's dummy read).
+  // The address only moves on reads outside of read-modify-write mode.
+  const uint8_t value = state->read_latch;
+  state->read_latch = state->pixels[state->active_page * GDDRAM_COLUMNS + state->active_column];
+  if (!state->read_modify_write) {
+    sh1107_advance_address(state);
+  }
+  return value;
 }
 
 static bool sh1107_i2c_write(void *user_data, uint8_t value)
 {
   sh1107_state_t *state = user_data;
+  if (state->trace_enabled)
+  {
+    sh1107_trace_write(state, value);
+  }
+  if (state->burst_write)
+  {
+    state->burst_write(state, value);
+    return true;
+  }
+  state->stats.i2c_bytes++;
   if (state->control_byte)
   {
     state->command_mode = !(value & SH1107_CONTROL_DC);
     state->continuous_mode = !(value & SH1107_CONTROL_CO);
     state->control_byte = false;
+    if (state->continuous_mode)
+    {
+      // Everything up to the end of the transaction is GDDRAM data, or commands
+      if (state->command_mode)
+      {
+        sh1107_begin_command_burst(state);
+      }
+      else
+      {
+        sh1107_begin_burst(state);
+      }
+    }
   }
   else
   {
     if (state->command_mode)
     {
+      state->stats.command_bytes++;
       state->current_command[state->current_command_index] = value;
       if (!state->current_command_index)
       {
-        state->current_command_length = 1 + multi_byte_commands[value];
+        state->current_command_length = 1 + sh1107_commands[value].params;
       }
       state->current_command_index++;
       if (state->current_command_index < state->current_command_length)
@@ -333,7 +1704,11 @@ static bool sh1107_i2c_write(void *user_data, uint8_t value)
     }
     else
     {
-      sh1107_process_data(state, value);
+      state->stats.data_bytes++;
+      if (!state->mcu_buffer)
+      {
+        sh1107_process_data(state, value);
+      }
     }
     if (!state->continuous_mode)
     {
@@ -343,19 +1718,107 @@ static bool sh1107_i2c_write(void *user_data, uint8_t value)
   return true;
 }
 
+// Panel tint presets of the color attribute, which also accepts "#rrggbb"
+static const struct
+{
+  const char *name;
+  uint32_t color;
+} sh1107_colors[] = {
+    {"white", 0xffffff},
+    {"blue", 0x3cb4ff},
+    {"yellow", 0xffd200},
+};
+
+static bool sh1107_parse_color(const char *text, uint32_t *color)
+{
+  for (uint32_t i = 0; i < sizeof(sh1107_colors) / sizeof(sh1107_colors[0]); i++) {
+    if (!strcmp(text, sh1107_colors[i].name)) {
+      *color = sh1107_colors[i].color;
+      return true;
+    }
+  }
+  if (text[0] != '#' || strlen(text) != 7) {
+    return false;
+  }
+  uint32_t value = 0;
+  for (const char *digit = text + 1; *digit; digit++) {
+    const char c = *digit | 0x20; // lower case
+    if (c >= '0' && c <= '9') {
+      value = value << 4 | (c - '0');
+    } else if (c >= 'a' && c <= 'f') {
+      value = value << 4 | (c - 'a' + 10);
+    } else {
+      return false;
+    }
+  }
+  *color = value;
+  return true;
+}
+
+static void sh1107_color_init(sh1107_state_t *state)
+{
+  const string_t color_attr = attr_string_init("color");
+  char text[COLOR_NAME_LENGTH];
+  if (string_read(color_attr, text, sizeof(text)) && !sh1107_parse_color(text, &state->color)) {
+    printf("SH1107: unknown color %s, using white\n", text);
+  }
+}
+
+// Makes the whole pool available again, for hosts that run chip_init() repeatedly in the
+// same memory (the benchmark harness). The simulator starts every run with a fresh module.
+void sh1107_release_instances(void)
+{
+  sh1107_instance_count = 0;
+  sh1107_mcu_snapshot_count = 0;
+  sh1107_trace_count = 0;
+  sh1107_capture_count = 0;
+#if SH1107_REFERENCE_CHECK
+  sh1107_sent_image_count = 0;
+#endif
+}
+
 void chip_init(void)
 {
-  sh1107_state_t *chip = malloc(sizeof(sh1107_state_t));
+  if (sh1107_instance_count == SH1107_MAX_INSTANCES) {
+    printf("SH1107: too many displays, only %d are supported\n", SH1107_MAX_INSTANCES);
+    return;
+  }
+  sh1107_state_t *chip = &sh1107_instances[sh1107_instance_count++];
 
   sh1107_reset(chip);
 
+  chip->refresh_interval = attr_read(attr_init("refreshInterval", DEFAULT_REFRESH_INTERVAL));
+  chip->adaptive_refresh = attr_read(attr_init("adaptiveRefresh", false));
+  chip->low_latency = attr_read(attr_init("lowLatency", false));
+  chip->present_on_stop = false;
+  chip->address = attr_read(attr_init("address", DEFAULT_I2C_ADDRESS)) & 0x7f;
+  if (attr_read(attr_init("traceI2C", false))) {
+    chip->trace = sh1107_pool_take(sh1107_traces, &sh1107_trace_count, SH1107_MAX_TRACES, sizeof(sh1107_traces[0]),
+                                   "traceI2C");
+    chip->trace_enabled = chip->trace != NULL;
+  }
+  chip->frame_interval = chip->refresh_interval;
+  chip->panel_timing = attr_read(attr_init("panelTiming", false));
+  sh1107_update_panel_timing(chip);
+  chip->x_offset = attr_read(attr_init("xOffset", chip->x_offset)) & GDDRAM_COLUMN_MASK;
+  sh1107_color_init(chip);
+#if SH1107_REFERENCE_CHECK
+  if (attr_read(attr_init("referenceCheck", false))) {
+    chip->sent_image = sh1107_pool_take(sh1107_sent_images, &sh1107_sent_image_count, SH1107_MAX_INSTANCES,
+                                        sizeof(sh1107_sent_images[0]), "referenceCheck");
+    chip->reference_check = chip->sent_image != NULL;
+  }
+#endif
+  chip->last_frame_nanos = 0;
+
   const i2c_config_t i2c = {
-    .address = 0x3c,
+    .address = chip->address,
     .scl = pin_init("SCL", INPUT_PULLUP),
     .sda = pin_init("SDA", INPUT_PULLUP),
     .connect = sh1107_i2c_connect,
     .read = sh1107_i2c_read,
     .write = sh1107_i2c_write,
+    .disconnect = sh1107_i2c_disconnect,
     .user_data = chip,
   };
 
@@ -366,6 +1829,49 @@ void chip_init(void)
     .user_data = chip,
   };
   chip->update_timer = timer_init(&update_timer_config);
+  sh1107_mcu_init(chip);
+
+  if (chip->trace_enabled) {
+    sh1107_trace_init(chip);
+    const timer_config_t trace_timer_config = {
+      .callback = sh1107_trace_timer_callback,
+      .user_data = chip,
+    };
+    chip->trace_timer = timer_init(&trace_timer_config);
+    timer_start(chip->trace_timer, TRACE_FLUSH_INTERVAL, true);
+  }
+
+  if (attr_read(attr_init("captureFrames", false))) {
+    chip->captures = sh1107_pool_take(sh1107_captures, &sh1107_capture_count, SH1107_MAX_CAPTURES,
+                                      sizeof(sh1107_captures[0]), "captureFrames");
+    chip->capture_enabled = chip->captures != NULL;
+  }
+  if (chip->capture_enabled) {
+    const timer_config_t capture_timer_config = {
+      .callback = sh1107_capture_timer_callback,
+      .user_data = chip,
+    };
+    chip->capture_timer = timer_init(&capture_timer_config);
+    timer_start(chip->capture_timer, CAPTURE_FLUSH_INTERVAL, true);
+  }
+
+  chip->stats_frames = attr_read(attr_init("statsFrames", 0));
+  chip->stats_interval = attr_read(attr_init("statsInterval", 0));
+  if (chip->stats_interval) {
+    const timer_config_t stats_timer_config = {
+      .callback = sh1107_stats_timer_callback,
+      .user_data = chip,
+    };
+    chip->stats_timer = timer_init(&stats_timer_config);
+    timer_start(chip->stats_timer, chip->stats_interval * 1000, true);
+  }
 
   chip->framebuffer = framebuffer_init(&chip->width, &chip->height);
+  chip->stride = chip->width;
+  if (chip->width > GDDRAM_COLUMNS || chip->height > GDDRAM_ROWS) {
+    printf("SH1107: display size %ux%u is larger than the GDDRAM, showing the top left %ux%u pixels\n",
+           chip->width, chip->height, GDDRAM_COLUMNS, GDDRAM_ROWS);
+    chip->width = chip->width > GDDRAM_COLUMNS ? GDDRAM_COLUMNS : chip->width;
+    chip->height = chip->height > GDDRAM_ROWS ? GDDRAM_ROWS : chip->height;
+  }
 }
@@ -0,0 +1,41 @@
+// Frame capture format of the SH1107 chip (captureFrames attribute), shared with the
+// decoder in bench/bench.c.
+//
+// SPDX-License-Identifier: MIT
+// Copyright (C) 2024 Uri Shaked / wokwi.com
+
+#ifndef SH1107_CAPTURE_H
+#define SH1107_CAPTURE_H
+
+// Each record is printed as hex on one line starting with CAPTURE_LINE_PREFIX, the I2C
+// address of the chip (2 hex digits) and ": ", as in the I2C trace. A record
+// is a tag byte followed by a tag-specific payload. Varints are LEB128.
+//
+// CAPTURE_HEADER: CAPTURE_VERSION, panel width, panel height (one byte each).
+// CAPTURE_FRAME: the simulated time since the previous frame in nanoseconds (varint,
+// since the start of the simulation for the first one), the CAPTURE_SETTINGS_SIZE
+// settings bytes, then the GDDRAM content (16 pages of 128 columns, 1 bit per pixel)
+// XORed with the previous frame (all zeros before the first one), as runs: the number
+// of unchanged bytes (varint), and unless that reaches the end of the GDDRAM, the number
+// of changed bytes (varint) followed by their XOR values.
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER 0x00
+#define CAPTURE_FRAME 0x01
+#define CAPTURE_LINE_PREFIX "sh1107-capture "
+
+// Settings bytes of a CAPTURE_FRAME
+#define CAPTURE_SETTINGS_FLAGS 0 // CAPTURE_FLAG_* bits
+#define CAPTURE_SETTINGS_CONTRAST 1
+#define CAPTURE_SETTINGS_START_LINE 2
+#define CAPTURE_SETTINGS_DISPLAY_OFFSET 3
+#define CAPTURE_SETTINGS_MULTIPLEX 4 // multiplex ratio, number of driven COM lines - 1
+#define CAPTURE_SETTINGS_X_OFFSET 5
+#define CAPTURE_SETTINGS_SIZE 6
+
+#define CAPTURE_FLAG_DISPLAY_ON 0x01
+#define CAPTURE_FLAG_ALL_ON 0x02
+#define CAPTURE_FLAG_INVERT 0x04
+#define CAPTURE_FLAG_COM_REVERSE 0x08
+#define CAPTURE_FLAG_SEGMENT_REMAP 0x10
+
+#endif /* SH1107_CAPTURE_H */
@@ -0,0 +1,24 @@
+// I2C trace format of the SH1107 chip (traceI2C attribute), shared with the
+// replay code in bench/bench.c.
+//
+// SPDX-License-Identifier: MIT
+// Copyright (C) 2024 Uri Shaked / wokwi.com
+
+#ifndef SH1107_TRACE_H
+#define SH1107_TRACE_H
+
+// The trace is a byte stream starting with TRACE_MAGIC and TRACE_VERSION, followed by
+// records: a tag byte, the simulated time since the previous record in nanoseconds
+// (LEB128 varint), and a tag-specific payload.
+// It is printed as hex on lines starting with TRACE_LINE_PREFIX, the I2C address of the
+// chip (2 hex digits) and ": ", so that the traces of several displays can be told apart.
+// Only the first line of each chip starts with TRACE_MAGIC.
+#define TRACE_MAGIC "SH17"
+#define TRACE_VERSION 1
+#define TRACE_START 0x01 // payload: address << 1 | read
+#define TRACE_STOP 0x02  // no payload
+#define TRACE_WRITE 0x03 // payload: length byte, then the written bytes
+#define TRACE_READ 0x04  // no payload, one record per byte read
+#define TRACE_LINE_PREFIX "sh1107-trace "
+
+#endif /* SH1107_TRACE_H */